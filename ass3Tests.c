@@ -1,6 +1,8 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "fcntl.h"
+#include "mman.h"
 
 #define PGSIZE 4096
 char in[3];
@@ -71,7 +73,7 @@ int main(int argc, char *argv[]){
   if(fork() == 0){
     for(int i = 0; i < 28; i++){
         printf(1, "doing sbrk number %d\n", i);
-        sbrk(PGSIZE);
+        *sbrk(PGSIZE) = i;  //sbrk is lazy, touch the page to allocate it
     }
     printf(1, "------------child --> allocated_memory_pages: 16 paged_out: 16------------\n");
     printf(1, "--------for our output press CTRL^P:--------\n");
@@ -127,6 +129,266 @@ int main(int argc, char *argv[]){
     printf(1, "%d", *pages[17]);
   }
   wait();
+
+  //LAZY TEST - sbrk only reserves memory, pages are allocated on first touch
+  printf(1, "--------------------LAZY TEST:----------------------\n");
+  if(fork() == 0){
+    int before = getNumberOfFreePages();
+    char* lazy = sbrk(10*PGSIZE);
+    printf(1, "free pages after sbrk of 10 pages: expected %d, our output: %d\n", before, getNumberOfFreePages());
+    lazy[3*PGSIZE] = 1;
+    printf(1, "free pages after touching 1 page: expected %d, our output: %d\n", before - 1, getNumberOfFreePages());
+    printf(1, "untouched page reads as zero: expected 0, our output: %d\n", lazy[5*PGSIZE]);
+    printf(1, "free pages after reading 1 page: expected %d, our output: %d\n", before - 1, getNumberOfFreePages());
+    lazy[5*PGSIZE] = 1;
+    printf(1, "free pages after writing it: expected %d, our output: %d\n", before - 2, getNumberOfFreePages());
+    exit();
+  }
+  wait();
+  //BUDDY TEST - every free page is in exactly one free buddy block
+  printf(1, "--------------------BUDDY TEST:----------------------\n");
+  {
+    int blocks, inblocks = 0;
+    for(int order=0; (blocks = getNumberOfFreeBlocks(order)) >= 0; order++)
+      inblocks += blocks << order;
+    printf(1, "free pages in buddy blocks: expected %d, our output: %d\n", getNumberOfFreePages(), inblocks);
+    printf(1, "bad order: expected -1, our output: %d\n", getNumberOfFreeBlocks(-1));
+  }
+  //EXEC TEST - program pages are read in from the binary on first touch
+  printf(1, "--------------------EXEC TEST:----------------------\n");
+  if(fork() == 0){
+    char *args[] = {"echo", "exec", "of", "a", "demand-paged", "binary", 0};
+    exec("echo", args);
+    printf(1, "exec failed\n");
+    exit();
+  }
+  wait();
+  //MMAP TEST - anonymous and file mappings
+  printf(1, "--------------------MMAP TEST:----------------------\n");
+  if(fork() == 0){
+    char *anon = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    anon[PGSIZE] = 7;
+    printf(1, "private anonymous mapping: expected 7 0, our output: %d %d\n", anon[PGSIZE], anon[0]);
+    char *shared = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(fork() == 0){
+      shared[0] = 42;
+      exit();
+    }
+    wait();
+    printf(1, "shared anonymous mapping after child wrote it: expected 42, our output: %d\n", shared[0]);
+    int fd = open("mmapfile", O_CREATE|O_RDWR);
+    write(fd, "hello world", 11);
+    char *map = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    map[0] = 'j';
+    msync(map, PGSIZE);
+    munmap(map, PGSIZE);
+    close(fd);
+    char buf[12];
+    fd = open("mmapfile", O_RDONLY);
+    read(fd, buf, 11);
+    buf[11] = 0;
+    printf(1, "shared file mapping written back: expected jello world, our output: %s\n", buf);
+    close(fd);
+    fd = open("mmapfile", O_RDONLY);
+    printf(1, "read into a mapping: expected 11, our output: %d\n", read(fd, anon, 11));
+    anon[11] = 0;
+    printf(1, "mapping read into: expected jello world, our output: %s\n", anon);
+    close(fd);
+    fd = open("mmapfile", O_RDWR);
+    map = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    map[0] = 'h';
+    int fd2 = open("mmapfile", O_RDWR);
+    read(fd2, buf, 11);
+    write(fd2, "!", 1);
+    close(fd2);
+    printf(1, "append seen by a mapping: expected !, our output: %c\n", map[11]);
+    munmap(map, PGSIZE);
+    char all[13];
+    int got = read(fd, all, 12);
+    all[got > 0 ? got : 0] = 0;
+    printf(1, "append kept by munmap: expected hello world!, our output: %s\n", all);
+    close(fd);
+    unlink("mmapfile");
+    exit();
+  }
+  wait();
+  //SHM TEST - unrelated processes share a segment by key
+  printf(1, "--------------------SHM TEST:----------------------\n");
+  if(fork() == 0){
+    int *seg = shmat(77, 2*PGSIZE);
+    seg[PGSIZE/sizeof(int)] = 1234;
+    if(fork() == 0){
+      exit();  //a child that only inherits the attachment
+    }
+    wait();
+    shmdt(seg);
+    exit();
+  }
+  wait();
+  if(fork() == 0){
+    int *seg = shmat(77, 2*PGSIZE);
+    printf(1, "segment freed with its last attachment: expected 0, our output: %d\n", seg[PGSIZE/sizeof(int)]);
+    seg[0] = 5;
+    if(fork() == 0){
+      int *again = shmat(77, PGSIZE);
+      again[0]++;
+      exit();
+    }
+    wait();
+    printf(1, "segment written by another process: expected 6, our output: %d\n", seg[0]);
+    exit();
+  }
+  wait();
+
+  //MADVISE TEST - dropped heap pages come back as zeros, advice is checked
+  printf(1, "--------------------MADVISE TEST:----------------------\n");
+  if(fork() == 0){
+    int *heap = (int*)sbrk(4*PGSIZE);
+    for(int i=0; i<4; i++)
+      heap[i*PGSIZE/sizeof(int)] = i+1;
+    madvise(heap, 4*PGSIZE, MADV_SEQUENTIAL);
+    madvise(heap, PGSIZE, MADV_COLD);
+    madvise(heap + PGSIZE/sizeof(int), PGSIZE, MADV_DONTNEED);
+    printf(1, "page kept: expected 1, our output: %d\n", heap[0]);
+    printf(1, "page dropped: expected 0, our output: %d\n", heap[PGSIZE/sizeof(int)]);
+    printf(1, "bad advice rejected: expected -1, our output: %d\n", madvise(heap, PGSIZE, 99));
+    exit();
+  }
+  wait();
+
+  //MLOCK TEST - locked pages stay put while the rest of the heap is paged
+  printf(1, "--------------------MLOCK TEST:----------------------\n");
+  if(fork() == 0){
+    int *hot = (int*)sbrk(2*PGSIZE);
+    hot[0] = 42;
+    printf(1, "mlock: expected 0, our output: %d\n", mlock(hot, 2*PGSIZE));
+    for(int i=0; i<20; i++)
+      *(int*)sbrk(PGSIZE) = i;
+    printf(1, "locked page data: expected 42, our output: %d\n", hot[0]);
+    printf(1, "over the limit: expected -1, our output: %d\n", mlock(hot + 2*PGSIZE/sizeof(int), 9*PGSIZE));
+    printf(1, "munlock: expected 0, our output: %d\n", munlock(hot, 2*PGSIZE));
+    exit();
+  }
+  wait();
+
+  //KSM TEST - two processes fill pages alike, the scanner merges them
+  printf(1, "--------------------KSM TEST:----------------------\n");
+  {
+    //set by the checking child, keeps the other one alive until then
+    volatile int *done = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    *done = 0;
+    ksm(16);
+    for(int c=0; c<2; c++){
+      if(fork() == 0){
+        int *same = (int*)sbrk(4*PGSIZE);
+        for(int i=0; i<4*PGSIZE/sizeof(int); i++)
+          same[i] = 7;
+        //stay on the CPU, the scanner runs on our ticks
+        int start = uptime();
+        if(c == 1){
+          int saved = 0;
+          while(saved == 0 && uptime() < start + 200)
+            saved = ksm(-1);
+          printf(1, "pages saved: expected > 0, our output: %d\n", saved);
+          *done = 1;
+        } else {
+          while(!*done && uptime() < start + 400)
+            ;
+        }
+        same[0] = 8;  //un-merge
+        if(same[0] != 8 || same[PGSIZE/sizeof(int)] != 7)
+          printf(1, "merged page data wrong\n");
+        exit();
+      }
+    }
+    wait();
+    wait();
+    ksm(0);
+    munmap((void*)done, PGSIZE);
+  }
+
+  //LARGE PAGE TEST - a big shared mapping gets 4 MiB pages, fork splits them
+  printf(1, "--------------------LARGE PAGE TEST:----------------------\n");
+  {
+    uint lpg = 4*1024*1024;
+    char *big = mmap(0, 2*lpg, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    char *aligned = (char*)(((uint)big + lpg - 1) & ~(lpg - 1));
+    struct pagestat st;
+    mincore(aligned, PGSIZE, &st);
+    printf(1, "large page: expected 1, our output: %d\n", (st.flags & MINCORE_LARGE) != 0);
+    aligned[lpg - 1] = 3;
+    if(fork() == 0){
+      aligned[lpg - 1]++;
+      exit();
+    }
+    wait();
+    printf(1, "shared after split: expected 4, our output: %d\n", aligned[lpg - 1]);
+    munmap(big, 2*lpg);
+  }
+
+  //PRESSURE TEST - the level can be polled without blocking, and a
+  //waiter for a level not reached blocks until it is killed
+  printf(1, "--------------------PRESSURE TEST:----------------------\n");
+  {
+    int level = mempressure(PRESSURE_NONE);
+    printf(1, "pressure level in range: expected 1, our output: %d\n", level >= PRESSURE_NONE && level <= PRESSURE_CRITICAL);
+    printf(1, "bad level: expected -1, our output: %d\n", mempressure(PRESSURE_CRITICAL + 1));
+    int fds[2];
+    pipe(fds);
+    int pid = fork();
+    if(pid == 0){
+      close(fds[0]);
+      level = mempressure(PRESSURE_CRITICAL);
+      write(fds[1], &level, sizeof(level));  //not reached once killed
+      exit();
+    }
+    close(fds[1]);
+    sleep(10);
+    kill(pid);
+    printf(1, "blocked until killed: expected 1, our output: %d\n", read(fds[0], &level, sizeof(level)) == 0);
+    close(fds[0]);
+    wait();
+  }
+  //READAHEAD TEST - blocks read ahead of a sequential reader hold the right data
+  printf(1, "--------------------READAHEAD TEST:----------------------\n");
+  {
+    int fd = open("ratest", O_CREATE|O_RDWR);
+    int blk[128], bad = 0;
+    for(int b=0; b<40; b++){
+      for(int i=0; i<128; i++)
+        blk[i] = b*128 + i;
+      write(fd, blk, sizeof(blk));
+    }
+    close(fd);
+    fd = open("ratest", O_RDONLY);
+    for(int b=0; b<40; b++){
+      read(fd, blk, sizeof(blk));
+      bad += blk[0] != b*128 || blk[127] != b*128 + 127;
+    }
+    close(fd);
+    printf(1, "bad blocks: expected 0, our output: %d\n", bad);
+    unlink("ratest");
+  }
+  //GROUP COMMIT TEST - small writes are batched, fsync waits for the commit
+  printf(1, "--------------------GROUP COMMIT TEST:----------------------\n");
+  {
+    int fd = open("gctest", O_CREATE|O_RDWR);
+    fsync(fd);
+    int commits = getNumberOfCommits();
+    for(int i=0; i<50; i++)
+      write(fd, &i, sizeof(i));
+    printf(1, "fsync: expected 0, our output: %d\n", fsync(fd));
+    commits = getNumberOfCommits() - commits;
+    printf(1, "commits for 50 writes: expected 1 to 49, our output: %d\n", commits);
+    close(fd);
+    int last = -1;
+    fd = open("gctest", O_RDONLY);
+    while(read(fd, &last, sizeof(last)) == sizeof(last))
+      ;
+    close(fd);
+    printf(1, "last value: expected 49, our output: %d\n", last);
+    unlink("gctest");
+  }
   printf(1, "**************************** All tests passed ****************************\n");
   exit();
 }
\ No newline at end of file
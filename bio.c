@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,79 +17,292 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Besides the NBUF buffers below, which are always there, the
+// cache grows with buffers from a slab cache (whose slabs are page
+// frames from kalloc) while there is memory to spare, see
+// buflimit; it prefers growing to throwing a cached block out.
+// When memory gets tight, bshrink gives the unused extra buffers
+// back. So the cache holds as much of the disk as memory allows,
+// and running out of buffers only happens when memory runs out.
+//
+// A buffer holding a block is on the hash chain of its
+// (dev, blockno) bucket; each bucket has its own lock, which
+// also protects the refcnt of its buffers, so lookups of
+// different blocks do not contend. Buffers nobody holds are
+// also on the free list, least recently released first, under
+// bcache.lock. Locks are taken in that order: a bucket, then
+// bcache.lock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 13      // hash buckets, a prime
+#define NODEV   (~0U)   // dev of a buffer on no hash chain
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;
+};
+
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct kmemCache *extra;  // buffers beyond NBUF come from here
+  uint nbuf;                // buffers in all, under lock
+
+  // Free list of buffers with refcnt 0, through prev/next.
+  // free.next is least recently used.
+  struct buf free;
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bucketof(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
+// Caller holds bcache.lock.
+static void
+freeunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  b->next = b->prev = 0;
+}
+
+// Put b on the free list, at the most recently used end, or at
+// the other end if it holds no block. Caller holds bcache.lock.
+static void
+freeadd(struct buf *b)
+{
+  struct buf *at;
+
+  at = b->dev == NODEV ? &bcache.free : bcache.free.prev;
+  b->next = at->next;
+  b->prev = at;
+  at->next->prev = b;
+  at->next = b;
+}
+
+// Most buffers the cache may have: NBUF, plus up to a quarter of
+// the free frames that are not needed to keep memory pressure
+// away (see parkSleepers) worth of buffers.
+static uint
+buflimit(void)
+{
+  uint spare;
+
+  if(freePgFrameCounter <= PARKLOWMARK)
+    return NBUF;
+  spare = (freePgFrameCounter - PARKLOWMARK) / 4;
+  return NBUF + spare * (PGSIZE / sizeof(struct buf));
+}
+
+static void
+bufctor(void *obj)
+{
+  initsleeplock(&((struct buf*)obj)->lock, "buffer");
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *h;
 
   initlock(&bcache.lock, "bcache");
+  bcache.extra = kmemCacheCreate("buf", sizeof(struct buf), bufctor);
+  bcache.nbuf = NBUF;
+  for(h = bcache.bucket; h < bcache.bucket+NBUCKET; h++)
+    initlock(&h->lock, "bcache.bucket");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Put all buffers on the free list, holding no block
+  bcache.free.prev = &bcache.free;
+  bcache.free.next = &bcache.free;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+    b->dev = NODEV;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    freeadd(b);
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Find block (dev, blockno) on bucket h, which the caller holds,
+// and take a reference to it. Returns 0 if it is not cached.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *h, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = h->head; b != 0; b = b->hnext){
     if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+      if(b->refcnt++ == 0){
+        acquire(&bcache.lock);
+        freeunlink(b);
+        release(&bcache.lock);
+      }
+      return b;
+    }
+  }
+  return 0;
+}
+
+static int
+isextra(struct buf *b)
+{
+  return b < bcache.buf || b >= bcache.buf+NBUF;
+}
+
+// Take the least recently used free buffer off the free list and
+// off its hash chain, only among the extra buffers if extraonly is
+// set. Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+// Returns 0 if there is no such buffer.
+static struct buf*
+bvictim(int extraonly)
+{
+  struct buf *b, **pp;
+  struct bucket *h;
+
+  for(;;){
+    acquire(&bcache.lock);
+    for(b = bcache.free.next; b != &bcache.free; b = b->next)
+      if((b->flags & B_DIRTY) == 0 && (!extraonly || isextra(b)))
+        break;
+    if(b == &bcache.free){
+      release(&bcache.lock);
+      return 0;
+    }
+    if(b->dev == NODEV){
+      freeunlink(b);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
+    // its bucket lock comes first
+    h = bucketof(b->dev, b->blockno);
+    release(&bcache.lock);
+    acquire(&h->lock);
+    acquire(&bcache.lock);
+    if(b->next != 0 && b->refcnt == 0 && (b->flags & B_DIRTY) == 0 &&
+       b->dev != NODEV && bucketof(b->dev, b->blockno) == h){
+      freeunlink(b);
+      release(&bcache.lock);
+      for(pp = &h->head; *pp != b; pp = &(*pp)->hnext)
+        ;
+      *pp = b->hnext;
+      b->hnext = 0;
+      release(&h->lock);
+      return b;
+    }
+    // someone took it meanwhile
+    release(&bcache.lock);
+    release(&h->lock);
   }
+}
+
+// A buffer holding no block: a new one while the cache may grow,
+// else the least recently used free one, else 0.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
+  acquire(&bcache.lock);
+  if(bcache.nbuf < buflimit()){
+    bcache.nbuf++;
+    release(&bcache.lock);
+    if((b = kmemCacheAlloc(bcache.extra)) != 0){
+      b->dev = NODEV;
       b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->refcnt = 0;
+      b->hnext = b->next = b->prev = 0;
       return b;
     }
+    acquire(&bcache.lock);
+    bcache.nbuf--;
+  }
+  release(&bcache.lock);
+  return bvictim(0);
+}
+
+// Give unused extra buffers back while the cache is bigger than
+// free memory allows. Called when memory is tight.
+void
+bshrink(void)
+{
+  struct buf *b;
+
+  for(;;){
+    acquire(&bcache.lock);
+    if(bcache.nbuf <= buflimit()){
+      release(&bcache.lock);
+      break;
+    }
+    release(&bcache.lock);
+    if((b = bvictim(1)) == 0)
+      break;
+    kmemCacheFree(bcache.extra, b);
+    acquire(&bcache.lock);
+    bcache.nbuf--;
+    release(&bcache.lock);
   }
-  panic("bget: no buffers");
+  // so the pages of emptied slabs go back to kalloc now
+  kmemCacheDrain(bcache.extra);
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct bucket *h;
+  struct buf *b, *victim;
+
+  h = bucketof(dev, blockno);
+
+  // Is the block already cached?
+  acquire(&h->lock);
+  if((b = bfind(h, dev, blockno)) != 0){
+    release(&h->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&h->lock);
+
+  // Not cached; recycle an unused buffer. The bucket lock is not
+  // held meanwhile, so look again before using it.
+  if((victim = bnew()) == 0)
+    panic("bget: no buffers");
+  acquire(&h->lock);
+  if((b = bfind(h, dev, blockno)) != 0){
+    release(&h->lock);
+    acquire(&bcache.lock);
+    victim->dev = NODEV;
+    freeadd(victim);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  b = victim;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->hnext = h->head;
+  h->head = b;
+  release(&h->lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -115,8 +328,93 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Write the n locked buffers b[0..n-1], which hold adjacent blocks
+// of one device in order, to disk with a single disk command.
+void
+bwritev(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+    b[i]->flags |= B_DIRTY;
+  }
+  iderwv(b, n);
+}
+
+// Start reading block blockno into the cache without waiting for
+// it, unless it is cached already. The buffer stays locked until
+// the disk is done with it, so bread of the block meanwhile waits
+// for the read to finish instead of starting another.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *h;
+  struct buf *b, *victim;
+
+  h = bucketof(dev, blockno);
+  acquire(&h->lock);
+  for(b = h->head; b != 0; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&h->lock);
+      return;
+    }
+  }
+  release(&h->lock);
+
+  // not worth waiting for memory or evicting dirty blocks for
+  if((victim = bnew()) == 0)
+    return;
+  acquire(&h->lock);
+  for(b = h->head; b != 0; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&h->lock);
+      acquire(&bcache.lock);
+      victim->dev = NODEV;
+      freeadd(victim);
+      release(&bcache.lock);
+      return;
+    }
+  }
+  b = victim;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->hnext = h->head;
+  h->head = b;
+  release(&h->lock);
+  // the buffer is new, but a bread may have found it already
+  acquiresleep(&b->lock);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->flags |= B_ASYNC;
+  ideread(b);
+}
+
+// Drop a reference to b, whose lock has been released.
+static void
+bput(struct buf *b)
+{
+  struct bucket *h;
+
+  h = bucketof(b->dev, b->blockno);
+  acquire(&h->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    acquire(&bcache.lock);
+    freeadd(b);
+    release(&bcache.lock);
+  }
+  release(&h->lock);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Move to the most recently used end of the free list.
 void
 brelse(struct buf *b)
 {
@@ -124,20 +422,16 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+// Called by ideintr when a read started by breadahead is done:
+// release the buffer on behalf of whoever started it.
+void
+bdone(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bput(b);
 }
 //PAGEBREAK!
 // Blank page.
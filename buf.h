@@ -4,11 +4,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *hnext; // hash bucket chain
+  struct buf *prev; // free list, least recently used first
   struct buf *next;
   struct buf *qnext; // disk queue
+  struct buf *bnext; // rest of a multi-block disk request
+  uint qtime;        // ticks when queued for the disk
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // read ahead: nobody waits, ideintr hands it back
 
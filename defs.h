@@ -2,9 +2,12 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmemCache;
+struct pagestat;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct shmSeg;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -20,6 +23,10 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bshrink(void);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -48,6 +55,7 @@ struct inode*   idup(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
+void            ishrink(void);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
@@ -72,6 +80,8 @@ int				isdirempty(struct inode *dp);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            ideread(struct buf*);
+void            iderwv(struct buf**, int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -80,12 +90,20 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kallocOrder(int);
+char*           kallocPages(int);
 void            kfree(char*);
+void            kfreeOrder(char*, int);
+int             kfreeBlocks(int);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 void            refDecrease(char*);
 void            refIncrease(char*);
 int             getPageRefs(char*);
+int             refDropShared(char*);
+void            rmapAdd(char*, pde_t*, uint);
+void            rmapRemove(char*, pde_t*, uint);
+int             getPageMapcount(char*);
 void            oldKfreeForInit(char*);
 
 
@@ -104,8 +122,12 @@ void            microdelay(int);
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+void            log_write_data(struct buf*);
+void            log_free(uint);
 void            begin_op();
 void            end_op();
+void            log_force(void);
+int             log_commits(void);
 
 // mp.c
 extern int      ismp;
@@ -115,19 +137,32 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// ksm.c
+void            ksminit(void);
+void            ksmScan(void);
+int             ksmControl(int);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
+void            pipeinit(void);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
+// pressure.c
+void            pressureinit(void);
+void            pressureReclaim(int);
+void            pressureTick(void);
+int             pressureWait(int);
+
 // proc.c
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -136,6 +171,8 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            idleSleep(void*, struct spinlock*, int);
+void            parkSleepers(void);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
@@ -144,6 +181,21 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// shm.c
+void            shminit(void);
+struct shmSeg*  shmGet(int, uint);
+void            shmDup(struct shmSeg*);
+void            shmPut(struct shmSeg*);
+uint            shmPages(struct shmSeg*);
+char*           shmFrame(struct shmSeg*, uint);
+
+// slab.c
+void            slabinit(void);
+struct kmemCache* kmemCacheCreate(char*, uint, void (*)(void*));
+void*           kmemCacheAlloc(struct kmemCache*);
+void            kmemCacheFree(struct kmemCache*, void*);
+void            kmemCacheDrain(struct kmemCache*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -171,6 +223,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argbuf(int, char**, int, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -199,13 +252,33 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 pde_t*			copyOnCow(pde_t*, uint);
+int             unsharePgtab(pde_t*, uint);
+int             lazyAlloc(uint, int);
+void            zeroinit(void);
+int             makeResident(uint, uint, int);
+uint            userLimit(uint, int);
+int             userShared(uint);
+void            pagecacheinit(void);
+void            pageCacheWrite(struct inode*, char*, uint, uint);
+void            pageCacheTrunc(struct inode*);
+void            pageCacheDrop(struct inode*);
+int             vmaOverlap(struct proc*, uint, uint);
+int             vmaMap(uint, int, int, int, struct file*, struct shmSeg*, uint);
+int             vmaUnmap(uint, int);
+int             vmaSync(uint, int);
+void            vmaExit(void);
+int             memAdvise(uint, int, int);
+int             memLock(uint, int, int);
+void            memStat(uint, int, struct pagestat*);
+void            collapseScan(void);
+int             parkProc(struct proc*);
+void            unpark(void);
 
 
 // number of elements in fixed-size array
@@ -6,22 +6,28 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 int
 exec(char *path, char **argv) 
 {
   char *s, *last;
-  int i, off;
+  int i, off, nsegs;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *textip, *oldip;
   struct proghdr ph;
+  struct execSeg segs[MAX_EXEC_SEGS];
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
   //backing up process data
   int physCount = curproc->physCounter;
   int swapCount = curproc->fileCounter;
+  int lockedCount = curproc->lockedPages;
   struct memPage savePages[MAX_TOTAL_PAGES];
   struct memPage * physHeadTmp = curproc->physHead;
 
@@ -34,6 +40,7 @@ exec(char *path, char **argv)
   }
   ilock(ip);
   pgdir = 0;
+  textip = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -65,21 +72,27 @@ exec(char *path, char **argv)
       curproc->allPages[i].next = 0;
     //TASK 3//
       curproc->allPages[i].pageData.ageCounter = SELECTION == LAPA ? 0xFFFFFFFF : 0;
+      curproc->allPages[i].pageData.locked = 0;
+      curproc->allPages[i].pageData.parked = 0;
     /////////
     }
     //TASK 4
     curproc->pageFaults = 0;
     curproc->pageTotalNumberOfPagedOut = 0;
     //
-    memset(&curproc->freeOffsetInFile,0,17);
+    memset(&curproc->freeOffsetInFile,0,sizeof(curproc->freeOffsetInFile));
     curproc->swapFile = 0;
     curproc->physHead = 0;
     curproc->physCounter = 0;
     curproc->fileCounter = 0;
+    curproc->lockedPages = 0;
   }
 
-  // Load program into memory.
+  // Record the loadable segments. Nothing is read yet: each page
+  // is read in from ip on its first touch (see lazyAlloc), so ip
+  // stays referenced for as long as the image runs.
   sz = 0;
+  nsegs = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -87,17 +100,26 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(nsegs == MAX_EXEC_SEGS)
       goto bad;
+    segs[nsegs].va = ph.vaddr;
+    segs[nsegs].off = ph.off;
+    segs[nsegs].filesz = ph.filesz;
+    segs[nsegs].memsz = ph.memsz;
+    segs[nsegs].writable = (ph.flags & ELF_PROG_FLAG_WRITE) != 0;
+    nsegs++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  iunlock(ip);
   end_op();
+  textip = ip;
   ip = 0;
 
   // Allocate two pages at the next page boundary.
@@ -134,11 +156,17 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  vmaExit();
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
+  oldip = curproc->execip;
+  curproc->execip = textip;
+  memmove(curproc->execSegs, segs, sizeof(segs));
+  curproc->nexecSegs = nsegs;
+  curproc->madvice = 0;
 
   if(SELECTION != NONE){
     //create new swapfile
@@ -149,6 +177,11 @@ exec(char *path, char **argv)
   }
   switchuvm(curproc);
   freevm(oldpgdir);
+  if(oldip){
+    begin_op();
+    iput(oldip);
+    end_op();
+  }
 
   return 0;
 
@@ -159,9 +192,15 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(textip){
+    begin_op();
+    iput(textip);
+    end_op();
+  }
   if(SELECTION != NONE){
     curproc->physCounter = physCount;
     curproc->fileCounter = swapCount;
+    curproc->lockedPages = lockedCount;
     curproc->physHead = physHeadTmp;
 
     //restoring process data in case of failure
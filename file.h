@@ -14,6 +14,8 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *prev; // icache list, protected by icache.lock
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -23,6 +25,10 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  struct cachePage *pages; // pages of the file in use (vm.c)
+  uint raoff;         // where the last readi ended
+  uint rawin;         // readahead window in blocks, 0 if not sequential
+  uint ranext;        // first block not read ahead yet
 };
 
 // table mapping major device number to
@@ -48,7 +48,7 @@ bzero(int dev, int bno)
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  log_write_data(bp);  // logged later if it becomes metadata
   brelse(bp);
 }
 
@@ -94,6 +94,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -121,18 +122,22 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to a cache entry (open files and
+//   current directories). iget() finds or creates a cache
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref falls to zero stays cached, with the
+//   pages cached on it, unless it no longer holds a valid
+//   inode; the list of entries is kept in least recently
+//   used order, and the least recently used unreferenced
+//   entries go back to the inode slab cache when there are
+//   more than NINODE of them or memory gets tight (ishrink).
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -156,8 +161,8 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
+// The icache.lock spin-lock protects the list of icache
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
 //
@@ -167,18 +172,88 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmemCache *cache;  // in-memory inodes come from here
+  struct inode *head;       // cached inodes, most recently used first
+  struct inode *tail;
+  int nunused;              // cached inodes with ref 0
 } icache;
 
+// Take ip off the icache list. Caller holds icache.lock.
+static void
+iunlink(struct inode *ip)
+{
+  if(ip->prev)
+    ip->prev->next = ip->next;
+  else
+    icache.head = ip->next;
+  if(ip->next)
+    ip->next->prev = ip->prev;
+  else
+    icache.tail = ip->prev;
+  ip->prev = ip->next = 0;
+}
+
+// Put ip at the front of the icache list. Caller holds icache.lock.
+static void
+ipush(struct inode *ip)
+{
+  ip->prev = 0;
+  ip->next = icache.head;
+  if(icache.head)
+    icache.head->prev = ip;
+  else
+    icache.tail = ip;
+  icache.head = ip;
+}
+
+// Free unreferenced inodes, least recently used first, until at
+// most keep are left.
+static void
+iprune(int keep)
+{
+  struct inode *ip, *prev, *gone;
+
+  gone = 0;
+  acquire(&icache.lock);
+  for(ip = icache.tail; ip != 0 && icache.nunused > keep; ip = prev){
+    prev = ip->prev;
+    if(ip->ref == 0){
+      iunlink(ip);
+      icache.nunused--;
+      ip->next = gone;
+      gone = ip;
+    }
+  }
+  release(&icache.lock);
+
+  while((ip = gone) != 0){
+    gone = ip->next;
+    pageCacheDrop(ip);
+    kmemCacheFree(icache.cache, ip);
+  }
+}
+
+// Memory is tight: give back every unreferenced inode and the
+// pages cached on it.
+void
+ishrink(void)
+{
+  iprune(0);
+  kmemCacheDrain(icache.cache);
+}
+
+// Slab constructor: a free inode keeps its initialized sleep-lock.
+static void
+inodector(void *obj)
+{
+  initsleeplock(&((struct inode*)obj)->lock, "inode");
+}
+
 void
 iinit(int dev)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.cache = kmemCacheCreate("inode", sizeof(struct inode), inodector);
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
@@ -243,31 +318,33 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.head; ip != 0; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        icache.nunused--;
+      iunlink(ip);
+      ipush(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate a new inode cache entry.
+  if((ip = kmemCacheAlloc(icache.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->pages = 0;
+  ip->raoff = ip->rawin = ip->ranext = 0;
+  ipush(ip);
   release(&icache.lock);
 
   return ip;
@@ -349,8 +426,23 @@ iput(struct inode *ip)
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&icache.lock);
+    return;
+  }
+  if(!ip->valid){
+    // freed above, or never read: nothing worth keeping
+    iunlink(ip);
+    release(&icache.lock);
+    pageCacheDrop(ip);
+    kmemCacheFree(icache.cache, ip);
+    return;
+  }
+  // last reference: keep the entry cached, unused
+  int unused = ++icache.nunused;
   release(&icache.lock);
+  if(unused > NINODE)
+    iprune(NINODE);
 }
 
 // Common idiom: unlock, then put.
@@ -433,6 +525,8 @@ itrunc(struct inode *ip)
   }
 
   ip->size = 0;
+  if(ip->pages)
+    pageCacheTrunc(ip);
   iupdate(ip);
 }
 
@@ -448,6 +542,37 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// A readi of n bytes at off is about to happen. If it starts where
+// the last one ended, the file is being read sequentially: double
+// the readahead window, up to MAXREADAHEAD blocks, and start reading
+// the blocks up to that far past the end of this read, so the disk
+// works on them while the caller uses this data. Anything else
+// closes the window. Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, last, end;
+
+  if(n == 0)
+    return;
+  if(off != ip->raoff){
+    ip->raoff = off + n;
+    ip->rawin = 0;
+    ip->ranext = 0;
+    return;
+  }
+  ip->raoff = off + n;
+  ip->rawin = ip->rawin ? min(ip->rawin*2, MAXREADAHEAD) : 2;
+
+  last = (off + n - 1) / BSIZE;
+  end = min(last + 1 + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  bn = ip->ranext > last ? ip->ranext : last + 1;
+  for(; bn < end; bn++)
+    breadahead(ip->dev, bmap(ip, bn));
+  if(bn > ip->ranext)
+    ip->ranext = bn;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
@@ -468,6 +593,7 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  readahead(ip, off, n);
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -501,9 +627,14 @@ writei(struct inode *ip, char *src, uint off, uint n)
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(ip->type == T_DIR)
+      log_write(bp);
+    else
+      log_write_data(bp);
     brelse(bp);
   }
+  if(ip->pages)
+    pageCacheWrite(ip, src - n, off - n, n);
 
   if(n > 0 && off > ip->size){
     ip->size = off;
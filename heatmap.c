@@ -0,0 +1,110 @@
+// Page heatmap: run a small workload and draw, once per tick, one
+// row with a character per heap page, from mincore().
+//
+//   heatmap [npages [rounds]]
+//
+// The first quarter of the pages is touched every round, a window
+// of the same size slides over the rest. Resident pages are drawn
+// by how recently the policy saw them used (the set bits in the top
+// byte of their age counter), hottest last:
+//   . : - = + * # % @
+// and the other states as
+//   _ untouched   z zero page   s swapped out
+// The last row marks c copy-on-write, l locked, S shared pages.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "mman.h"
+
+#define PGSIZE 4096
+#define MAXPAGES 64
+
+static char ramp[] = ".:-=+*#%@";
+
+static int
+heat(uint age)
+{
+  int n = 0;
+
+  for(age >>= 24; age; age >>= 1)
+    n += age & 1;
+  return n;
+}
+
+static void
+draw(char *base, int npages, int round)
+{
+  struct pagestat st[MAXPAGES];
+  char row[MAXPAGES+1];
+  int i;
+
+  if(mincore(base, npages*PGSIZE, st) < 0){
+    printf(2, "heatmap: mincore failed\n");
+    exit();
+  }
+  for(i = 0; i < npages; i++){
+    if(st[i].flags & MINCORE_SWAPPED)
+      row[i] = 's';
+    else if(st[i].flags & MINCORE_ZERO)
+      row[i] = 'z';
+    else if(st[i].flags & MINCORE_RESIDENT)
+      row[i] = ramp[heat(st[i].age)];
+    else
+      row[i] = '_';
+  }
+  row[npages] = 0;
+  if(round < 0){
+    for(i = 0; i < npages; i++){
+      if(st[i].flags & MINCORE_COW)
+        row[i] = 'c';
+      else if(st[i].flags & MINCORE_LOCKED)
+        row[i] = 'l';
+      else if(st[i].flags & MINCORE_SHARED)
+        row[i] = 'S';
+      else
+        row[i] = ' ';
+    }
+    printf(1, "flags |%s|\n", row);
+  } else
+    printf(1, "%d\t|%s|\n", round, row);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int npages = 24, rounds = 20;
+  int hot, r, i, w;
+  char *base;
+  uint brk;
+
+  if(argc > 1)
+    npages = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(npages < 4 || npages > MAXPAGES || rounds < 1){
+    printf(2, "usage: heatmap [npages (4-%d) [rounds]]\n", MAXPAGES);
+    exit();
+  }
+
+  brk = (uint)sbrk(0);
+  sbrk((PGSIZE - brk % PGSIZE) % PGSIZE);
+  base = sbrk(npages*PGSIZE);
+  if(base == (char*)-1){
+    printf(2, "heatmap: sbrk failed\n");
+    exit();
+  }
+
+  hot = npages / 4;
+  for(r = 0; r < rounds; r++){
+    for(i = 0; i < hot; i++)
+      base[i*PGSIZE]++;
+    w = hot + (r*hot) % (npages - hot);
+    for(i = 0; i < hot && w + i < npages; i++)
+      base[(w + i)*PGSIZE]++;
+    sleep(1);
+    draw(base, npages, r);
+  }
+  draw(base, npages, -1);
+  exit();
+}
@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code. Transfers use bus-master DMA when the
+// controller supports it, programmed I/O otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -23,16 +24,61 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+// Bus-master registers of the primary channel, from the
+// controller's PCI BAR4.
+#define BM_CMD        0     // command
+#define BM_STATUS     2     // status
+#define BM_PRDT       4     // physical address of the PRD table
+#define BM_START      0x01  // command: start the transfer
+#define BM_TOMEM      0x08  // command: disk to memory
+#define BM_ERR        0x02  // status: error, write 1 to clear
+#define BM_INTR       0x04  // status: interrupt, write 1 to clear
+
+// A physical region descriptor: one piece of memory for DMA, not
+// crossing a 64 KiB boundary.
+struct prd {
+  uint addr;
+  ushort count;  // bytes, 0 meaning 64 KiB
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last entry of the table
+#define NPRD (PGSIZE/sizeof(struct prd))
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
 // You must hold idelock while manipulating queue.
+//
+// A request may cover several adjacent blocks, the bufs after the
+// first chained through bnext. It is one disk command, and the data
+// moves a block per interrupt; idenext is the buf of the active
+// request whose data moves next.
+//
+// The requests behind the active one are an elevator queue: sorted
+// by block number, in the order of a sweep upwards from idepos that
+// wraps around to the lowest block (C-LOOK). A new request that
+// continues or precedes a queued one of the same kind is merged into
+// it, up to MAXREQBLOCKS blocks. So that a request far from the
+// sweep does not wait forever, one queued for more than READWAIT
+// ticks (WRITEWAIT for writes) goes next; expired reads first, since
+// someone is waiting for them, while writes are mostly commits.
+
+#define MAXREQBLOCKS (255/(BSIZE/SECTOR_SIZE))
+#define READWAIT   5
+#define WRITEWAIT 25
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *idenext;
+static uint idepos;         // block the sweep has got to
 
 static int havedisk1;
+static uint bmiba;          // bus-master base port, 0 if PIO only
+static struct prd *prdt;    // PRD table, one page
 static void idestart(struct buf*);
+static void ideschedule(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,12 +93,53 @@ idewait(int checkerr)
   return 0;
 }
 
+static uint
+pciread(uint bus, uint dev, uint fn, uint off)
+{
+  outl(0xcf8, 0x80000000 | (bus<<16) | (dev<<11) | (fn<<8) | (off & 0xfc));
+  return inl(0xcfc);
+}
+
+static void
+pciwrite(uint bus, uint dev, uint fn, uint off, uint v)
+{
+  outl(0xcf8, 0x80000000 | (bus<<16) | (dev<<11) | (fn<<8) | (off & 0xfc));
+  outl(0xcfc, v);
+}
+
+// Look on PCI bus 0 for a bus-mastering IDE controller, like
+// QEMU's PIIX, and set it up for DMA.
+static void
+dmainit(void)
+{
+  uint dev, fn, class, bar;
+
+  for(dev = 0; dev < 32; dev++){
+    for(fn = 0; fn < 8; fn++){
+      if((pciread(0, dev, fn, 0x00) & 0xffff) == 0xffff)
+        continue;
+      class = pciread(0, dev, fn, 0x08);
+      // mass storage, IDE, capable of bus mastering
+      if((class >> 16) != 0x0101 || !(class & 0x8000))
+        continue;
+      bar = pciread(0, dev, fn, 0x20);
+      if(!(bar & 1) || (prdt = (struct prd*)kalloc()) == 0)
+        return;
+      // enable I/O space and bus mastering
+      pciwrite(0, dev, fn, 0x04, pciread(0, dev, fn, 0x04) | 0x05);
+      bmiba = bar & ~3;
+      return;
+    }
+  }
+}
+
 void
 ideinit(void)
 {
   int i;
 
   initlock(&idelock, "ide");
+  dmainit();
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
 
@@ -69,13 +156,43 @@ ideinit(void)
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
+// Point the PRD table at the data of b and the bufs chained to it.
+static void
+dmaprep(struct buf *b)
+{
+  uint pa, n, i;
+
+  i = 0;
+  for(; b != 0; b = b->bnext){
+    pa = V2P(b->data);
+    // split where the data crosses a 64 KiB boundary
+    n = 0x10000 - (pa & 0xffff);
+    if(n > BSIZE)
+      n = BSIZE;
+    prdt[i].addr = pa;
+    prdt[i].count = n;
+    prdt[i++].flags = 0;
+    if(n < BSIZE){
+      prdt[i].addr = pa + n;
+      prdt[i].count = BSIZE - n;
+      prdt[i++].flags = 0;
+    }
+    if(i + 2 > NPRD)
+      panic("dmaprep: too many bufs");
+  }
+  prdt[i-1].flags = PRD_EOT;
+}
+
 // Start the request for b.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  int nblock = 0;
+  for(struct buf *c = b; c != 0; c = c->bnext)
+    nblock++;
+  if(b->blockno + nblock > FSSIZE)
     panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
@@ -83,19 +200,39 @@ idestart(struct buf *b)
   int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
   if (sector_per_block > 7) panic("idestart");
+  if (nblock * sector_per_block > 255) panic("idestart: too many blocks");
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nblock * sector_per_block);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+  if(bmiba){
+    // the whole request in one go, without the CPU
+    dmaprep(b);
+    outl(bmiba + BM_PRDT, V2P(prdt));
+    outb(bmiba + BM_STATUS, BM_ERR | BM_INTR);
+    if(b->flags & B_DIRTY){
+      outb(bmiba + BM_CMD, 0);
+      outb(0x1f7, IDE_CMD_WRDMA);
+      outb(bmiba + BM_CMD, BM_START);
+    } else {
+      outb(bmiba + BM_CMD, BM_TOMEM);
+      outb(0x1f7, IDE_CMD_RDDMA);
+      outb(bmiba + BM_CMD, BM_TOMEM | BM_START);
+    }
+    idenext = 0;
+    return;
+  }
   if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
     outsl(0x1f0, b->data, BSIZE/4);
+    idenext = b->bnext;
   } else {
     outb(0x1f7, read_cmd);
+    idenext = b;
   }
 }
 
@@ -103,7 +240,7 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *c, *next, *done;
 
   // First queued buffer is the active request.
   acquire(&idelock);
@@ -112,22 +249,167 @@ ideintr(void)
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(bmiba){
+    // Not done yet, or not ours.
+    if(!(inb(bmiba + BM_STATUS) & BM_INTR)){
+      release(&idelock);
+      return;
+    }
+    outb(bmiba + BM_CMD, 0);
+    outb(bmiba + BM_STATUS, BM_ERR | BM_INTR);
+    idewait(1);
+  } else if(!(b->flags & B_DIRTY)){
+    // Read the block that is in.
+    if(idewait(1) >= 0)
+      insl(0x1f0, idenext->data, BSIZE/4);
+    if((idenext = idenext->bnext) != 0){
+      release(&idelock);
+      return;
+    }
+  } else if(idenext != 0){
+    // The disk took the last block, hand it the next one.
+    outsl(0x1f0, idenext->data, BSIZE/4);
+    idenext = idenext->bnext;
+    release(&idelock);
+    return;
+  }
+  idequeue = b->qnext;
+  ideschedule();
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake process waiting for these bufs.
+  done = 0;
+  for(c = b; c != 0; c = next){
+    next = c->bnext;
+    c->bnext = 0;
+    c->flags |= B_VALID;
+    c->flags &= ~B_DIRTY;
+    wakeup(c);
+    if(c->flags & B_ASYNC){
+      c->flags &= ~B_ASYNC;
+      c->qnext = done;
+      done = c;
+    }
+  }
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
     idestart(idequeue);
 
   release(&idelock);
+
+  // Nobody waits for a read ahead; give it back to the cache.
+  for(; done != 0; done = next){
+    next = done->qnext;
+    bdone(done);
+  }
+}
+
+static struct buf*
+lastof(struct buf *b)
+{
+  while(b->bnext)
+    b = b->bnext;
+  return b;
+}
+
+static int
+nblocks(struct buf *b)
+{
+  int n;
+
+  for(n = 0; b != 0; b = b->bnext)
+    n++;
+  return n;
+}
+
+// Does request a come before b in the sweep from idepos?
+static int
+sweepsbefore(struct buf *a, struct buf *b)
+{
+  int awrap = a->blockno < idepos;
+  int bwrap = b->blockno < idepos;
+
+  if(awrap != bwrap)
+    return bwrap;
+  return a->blockno < b->blockno;
+}
+
+// Queue the request b (with the bufs chained to it), starting the
+// disk if it is idle. Caller must hold idelock.
+static void
+ideappend(struct buf *b)
+{
+  struct buf **pp, *r;
+
+  b->qnext = 0;
+  b->qtime = ticks;
+  if(idequeue == 0){
+    idequeue = b;
+    idepos = b->blockno;
+    idestart(b);
+    return;
+  }
+
+  // Merge with a queued request it continues or precedes.
+  for(pp = &idequeue->qnext; *pp; pp = &(*pp)->qnext){
+    r = *pp;
+    if(r->dev != b->dev || (r->flags & B_DIRTY) != (b->flags & B_DIRTY) ||
+       nblocks(r) + nblocks(b) > MAXREQBLOCKS)
+      continue;
+    if(lastof(r)->blockno + 1 == b->blockno){
+      lastof(r)->bnext = b;
+      return;
+    }
+    if(lastof(b)->blockno + 1 == r->blockno){
+      lastof(b)->bnext = r;
+      b->qnext = r->qnext;
+      b->qtime = r->qtime;
+      *pp = b;
+      return;
+    }
+  }
+
+  for(pp = &idequeue->qnext; *pp && !sweepsbefore(b, *pp); pp = &(*pp)->qnext)  //DOC:insert-queue
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// The active request is done: move the one to start next to the
+// front of idequeue. Caller must hold idelock.
+static void
+ideschedule(void)
+{
+  struct buf **pp, **oldest;
+  int reads;
+
+  if(idequeue == 0)
+    return;
+  oldest = 0;
+  reads = 0;
+  for(pp = &idequeue; *pp; pp = &(*pp)->qnext){
+    if((*pp)->flags & B_DIRTY){
+      if(reads || ticks - (*pp)->qtime < WRITEWAIT)
+        continue;
+    } else {
+      if(ticks - (*pp)->qtime < READWAIT)
+        continue;
+      if(!reads)
+        oldest = 0;
+      reads = 1;
+    }
+    if(oldest == 0 || (*pp)->qtime < (*oldest)->qtime)
+      oldest = pp;
+  }
+  if(oldest && oldest != &idequeue){
+    // out of the sweep's order; the sweep stays where it was
+    struct buf *b = *oldest;
+    *oldest = b->qnext;
+    b->qnext = idequeue;
+    idequeue = b;
+  } else
+    idepos = idequeue->blockno;
 }
 
 //PAGEBREAK!
@@ -137,8 +419,6 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
@@ -147,16 +427,8 @@ iderw(struct buf *b)
     panic("iderw: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
-
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
-
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  b->bnext = 0;
+  ideappend(b);
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
@@ -166,3 +438,53 @@ iderw(struct buf *b)
 
   release(&idelock);
 }
+
+// Start reading b from disk and return without waiting; b must be
+// locked, not valid and have B_ASYNC set. ideintr calls bdone when
+// the data is in.
+void
+ideread(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("ideread: buf not locked");
+  if(b->flags & (B_VALID|B_DIRTY))
+    panic("ideread: nothing to read");
+  if(b->dev != 0 && !havedisk1)
+    panic("ideread: ide disk 1 not present");
+
+  acquire(&idelock);
+  b->bnext = 0;
+  ideappend(b);
+  release(&idelock);
+}
+
+// Write (if B_DIRTY) or read the n locked bufs b[0..n-1], which
+// hold adjacent blocks of one device in order, with one disk
+// command, and wait until all of them are done.
+void
+iderwv(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&b[i]->lock))
+      panic("iderwv: buf not locked");
+    if((b[i]->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderwv: nothing to do");
+    if(i > 0 && (b[i]->dev != b[0]->dev || b[i]->blockno != b[0]->blockno + i ||
+                 (b[i]->flags & B_DIRTY) != (b[0]->flags & B_DIRTY)))
+      panic("iderwv: bufs not adjacent");
+  }
+  if(b[0]->dev != 0 && !havedisk1)
+    panic("iderwv: ide disk 1 not present");
+
+  acquire(&idelock);
+  for(i = 0; i < n; i++)
+    b[i]->bnext = i+1 < n ? b[i+1] : 0;
+  ideappend(b[0]);
+
+  // The bufs of the request finish together.
+  while((b[0]->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b[0], &idelock);
+  release(&idelock);
+}
@@ -1,6 +1,7 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Binary buddy allocator: hands out blocks of
+// 2^order contiguous 4096-byte pages, 0 <= order <= MAXORDER.
 
 #include "types.h"
 #include "defs.h"
@@ -18,17 +19,47 @@ extern char end[]; // first address after kernel loaded from ELF file
 uint freePgFrameCounter;
 uint totalPgFrameCounter;
 
+#define NFRAMES (PHYSTOP/PGSIZE)
+
+// Free blocks are doubly linked so that a free buddy can be
+// unlinked from the middle of its list when merging.
 struct run {
   struct run *next;
+  struct run *prev;
+};
+
+// Reverse mapping: one entry per user PTE that maps a frame.
+struct rmap {
+  pde_t *pgdir;        // address space mapping the frame
+  uint va;             // user virtual address it is mapped at
+  struct rmap *next;
+};
+
+// Physical page frame descriptor, one per frame below PHYSTOP.
+struct pgFrame {
+  uint flags;          // PGF_* below
+  int refs;            //TASK 2: page refs (mappings and kernel users)
+  int mapcount;        // number of user PTEs mapping the frame
+  struct rmap *rmap;   // those PTEs, as (pgdir, va) pairs
 };
 
+#define PGF_USER  0x1  // frame is mapped into user space
+
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
-  int refs[PHYSTOP/PGSIZE];   //TASK 2: array of ref counters (each cell holds counter of page refs for i'th page)
+  struct run *freelist[MAXORDER+1];  // free blocks of each order
+  uint nfree[MAXORDER+1];            // number of free blocks of each order
+  char freeorder[NFRAMES];           // order+1 of the free block starting at frame i, 0 if none
+  struct pgFrame frames[NFRAMES];
+  struct kmemCache *rmapcache;       // struct rmap entries come from here
 } kmem;
 
+#define FRAME(v) (&kmem.frames[V2P(v)/PGSIZE])
+
+static void buddyfree(char *v, int order);
+static void rmapFreeChain(struct rmap *r);
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -55,6 +86,7 @@ kinit2(void *vstart, void *vend)
   uint virtualEndAddr = PGROUNDDOWN((uint) vend);
   totalPgFrameCounter += (virtualEndAddr - virtualStartAddr) / PGSIZE;
   freePgFrameCounter = totalPgFrameCounter;
+  kmem.rmapcache = kmemCacheCreate("rmap", sizeof(struct rmap), 0);
   kmem.use_lock = 1;
 }
 
@@ -71,8 +103,6 @@ freerange(void *vstart, void *vend)
 void
 oldKfreeForInit(char *v)
 {
-  struct run *r;
-
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("oldKfreeForInit");
 
@@ -81,16 +111,131 @@ oldKfreeForInit(char *v)
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  buddyfree(v, 0);
   if(kmem.use_lock)
     release(&kmem.lock);
 }
 
+//PAGEBREAK: 30
+// Buddy free lists. Must be called with kmem.lock held
+// (or before use_lock is set).
+
+// Put the free block r of the given order at the head of its list.
+static void
+pushfree(struct run *r, int order)
+{
+  r->prev = 0;
+  r->next = kmem.freelist[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.freelist[order] = r;
+  kmem.freeorder[V2P(r)/PGSIZE] = order + 1;
+  kmem.nfree[order]++;
+}
 
+// Take the free block r of the given order off its list.
+static void
+unlinkfree(struct run *r, int order)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.freeorder[V2P(r)/PGSIZE] = 0;
+  kmem.nfree[order]--;
+}
+
+// Return the block at v to the free lists, merging it with
+// its buddy for as long as the buddy is a free block of the
+// same order.
+static void
+buddyfree(char *v, int order)
+{
+  uint pfn, buddy;
+
+  pfn = V2P(v) / PGSIZE;
+  while(order < MAXORDER){
+    buddy = pfn ^ (1 << order);
+    if(buddy >= NFRAMES || kmem.freeorder[buddy] != order + 1)
+      break;
+    unlinkfree((struct run*)P2V(buddy * PGSIZE), order);
+    pfn &= ~(1 << order);
+    order++;
+  }
+  pushfree((struct run*)P2V(pfn * PGSIZE), order);
+}
+
+// Remove a block of the given order from the free lists,
+// splitting the smallest larger block if none is free.
+static char*
+buddyalloc(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o <= MAXORDER && kmem.freelist[o] == 0; o++)
+    ;
+  if(o > MAXORDER)
+    return 0;
+  r = kmem.freelist[o];
+  unlinkfree(r, o);
+  // give the upper halves back until the block has the right size
+  while(o > order){
+    o--;
+    pushfree((struct run*)((char*)r + (PGSIZE << o)), o);
+  }
+  return (char*)r;
+}
 
 //PAGEBREAK: 21
+// Free the block of 2^order pages pointed at by v, which
+// normally should have been returned by a call to
+// kallocOrder() with the same order.  The block is only
+// returned to the free lists when its last reference is dropped.
+void
+kfreeOrder(char *v, int order)
+{
+  struct pgFrame *f;
+  struct rmap *stale;
+
+  if(order < 0 || order > MAXORDER || V2P(v) % (PGSIZE << order) ||
+     v < end || V2P(v) + (PGSIZE << order) > PHYSTOP)
+    panic("kfree");
+
+  // TASK 2: decrease ref counter of page, only free it when no refs left
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  f = FRAME(v);
+  if(f->refs == 0)
+    panic("cannot free page with 0 refs\n");
+  if(--f->refs > 0){
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  // nobody can reach the frame any more, drop what is left of its rmap
+  stale = f->rmap;
+  f->rmap = 0;
+  f->mapcount = 0;
+  f->flags = 0;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  rmapFreeChain(stale);
+
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << order);
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  buddyfree(v, order);
+  //TASK 4: freeing page frames -> update page frame counter
+  freePgFrameCounter += 1 << order;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
@@ -98,35 +243,55 @@ oldKfreeForInit(char *v)
 void
 kfree(char *v)
 {
-  struct run *r;
-  int refsNum;
+  kfreeOrder(v, 0);
+}
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-    panic("kfree");
-  
-  // TASK 2: decrease ref counter of page
-  refsNum = getPageRefs(v);
-  if(refsNum == 0){
-    panic("cannot free page with 0 refs\n");
+// Allocate 2^order physically contiguous pages, aligned
+// to their own size.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+char*
+kallocOrder(int order)
+{
+  char *v;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  v = buddyalloc(order);
+  if(v){
+    //TASK 4 -> allocating page frames -> updating page frame counter
+    freePgFrameCounter -= 1 << order;
+    //TASK 2: set ref counter of the block to 1
+    FRAME(v)->refs = 1;
   }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return v;
+}
 
-  refDecrease(v);
-  
-  // TASK 2: check that page ref == 0 -> if not, don't free page
-  if(getPageRefs(v) == 0){
-    // Fill with junk to catch dangling refs.
-    memset(v, 1, PGSIZE);
+// Like kallocOrder(), but every page of the block gets its own
+// ref, so that the pages can be freed one at a time with kfree().
+char*
+kallocPages(int order)
+{
+  char *v;
+  int i;
 
-    if(kmem.use_lock)
-      acquire(&kmem.lock);
-    r = (struct run*)v;
-    r->next = kmem.freelist;
-    kmem.freelist = r;
-    //TASK 4: freeing page frame -> update page frame counter
-    freePgFrameCounter++;
-    if(kmem.use_lock)
-      release(&kmem.lock);
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  v = buddyalloc(order);
+  if(v){
+    freePgFrameCounter -= 1 << order;
+    for(i = 0; i < (1 << order); i++)
+      FRAME(v + i*PGSIZE)->refs = 1;
   }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return v;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -139,19 +304,38 @@ kalloc(void)
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
+  // fast path: a free single page, no splitting needed
+  if((r = kmem.freelist[0]) != 0)
+    unlinkfree(r, 0);
+  else
+    r = (struct run*)buddyalloc(0);
   if(r){
     //TASK 4 -> allocating page frame -> updating page frame counter
     freePgFrameCounter--;
-    kmem.freelist = r->next;
     //TASK 2: set ref counter to 1
-    kmem.refs[(V2P((char*)r)/PGSIZE)] = 1;
+    FRAME(r)->refs = 1;
   }
   if(kmem.use_lock)
     release(&kmem.lock);
   return (char*)r;
 }
 
+// Number of free blocks of the given order.
+int
+kfreeBlocks(int order)
+{
+  int n;
+
+  if(order < 0 || order > MAXORDER)
+    return -1;
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = kmem.nfree[order];
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
+}
+
 //TASK 2: auxiliary funcs
 
 //increase refs of physical page
@@ -159,7 +343,7 @@ void refIncrease(char* vAddr){
   if(kmem.use_lock){
     acquire(&kmem.lock);
   }
-  kmem.refs[(V2P(vAddr)/PGSIZE)]++;
+  FRAME(vAddr)->refs++;
   if(kmem.use_lock){
     release(&kmem.lock);
   }
@@ -170,21 +354,121 @@ void refDecrease(char* vAddr){
   if(kmem.use_lock){
     acquire(&kmem.lock);
   }
-  kmem.refs[(V2P(vAddr)/PGSIZE)]--;
+  FRAME(vAddr)->refs--;
   if(kmem.use_lock){
     release(&kmem.lock);
   }
 }
 
+//drop one ref of a shared physical page, unless it is the last one.
+//returns 1 if a ref was dropped, 0 if the caller holds the only ref
+int refDropShared(char *vAddr){
+  int dropped = 0;
+  if(kmem.use_lock){
+    acquire(&kmem.lock);
+  }
+  if(FRAME(vAddr)->refs > 1){
+    FRAME(vAddr)->refs--;
+    dropped = 1;
+  }
+  if(kmem.use_lock){
+    release(&kmem.lock);
+  }
+  return dropped;
+}
+
 //get ref counter of physical page
 int getPageRefs(char *vAddr){
   int res = -1;
   if(kmem.use_lock){
     acquire(&kmem.lock);
   }
-  res = kmem.refs[(V2P(vAddr)/PGSIZE)];
+  res = FRAME(vAddr)->refs;
   if(kmem.use_lock){
     release(&kmem.lock);
   }
   return res;
-}
\ No newline at end of file
+}
+
+//PAGEBREAK: 30
+// Reverse mapping. Every user PTE that maps a frame is recorded
+// in the frame's rmap chain, so the kernel can find all the
+// address spaces sharing a frame (e.g. after copyOnCow()).
+
+// Record that pgdir maps the frame at kernel address v at user va.
+// Recording the same mapping twice is harmless.
+void rmapAdd(char *v, pde_t *pgdir, uint va){
+  struct pgFrame *f;
+  struct rmap *r, *q;
+
+  if((r = kmemCacheAlloc(kmem.rmapcache)) == 0)
+    panic("rmapAdd: out of memory");
+  r->pgdir = pgdir;
+  r->va = PGROUNDDOWN(va);
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  f = FRAME(v);
+  for(q = f->rmap; q != 0; q = q->next){
+    if(q->pgdir == r->pgdir && q->va == r->va){
+      if(kmem.use_lock)
+        release(&kmem.lock);
+      kmemCacheFree(kmem.rmapcache, r);
+      return;
+    }
+  }
+  r->next = f->rmap;
+  f->rmap = r;
+  f->mapcount++;
+  f->flags |= PGF_USER;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Forget that pgdir maps the frame at kernel address v at user va.
+void rmapRemove(char *v, pde_t *pgdir, uint va){
+  struct pgFrame *f;
+  struct rmap **pp, *r;
+
+  r = 0;
+  va = PGROUNDDOWN(va);
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  f = FRAME(v);
+  for(pp = &f->rmap; *pp != 0; pp = &(*pp)->next){
+    if((*pp)->pgdir == pgdir && (*pp)->va == va){
+      r = *pp;
+      *pp = r->next;
+      if(--f->mapcount == 0)
+        f->flags &= ~PGF_USER;
+      break;
+    }
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  if(r)
+    kmemCacheFree(kmem.rmapcache, r);
+}
+
+// Number of user PTEs mapping the frame at kernel address v.
+int getPageMapcount(char *v){
+  int n;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = FRAME(v)->mapcount;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
+}
+
+static void
+rmapFreeChain(struct rmap *r)
+{
+  struct rmap *next;
+
+  for(; r != 0; r = next){
+    next = r->next;
+    kmemCacheFree(kmem.rmapcache, r);
+  }
+}
@@ -0,0 +1,224 @@
+// Same-page merging.
+//
+// On each clock tick that interrupts a user process, ksmScan()
+// looks at the next few pages of that process and merges the ones
+// whose contents match a page seen before into a single frame.
+// The merged frame is mapped read-only and PTE_COW everywhere, so
+// a write to it breaks the sharing again through cowPgFault like
+// any other copy-on-write page.
+//
+// The table below remembers candidate frames by a hash of their
+// contents. An unstable entry is only a hint: it holds no ref, and
+// its frame may have changed or been freed since; its contents are
+// always compared before anything is merged. A frame becomes
+// stable when a page that did not change between two scans
+// matches another unstable frame. The table then holds a ref on
+// it and nobody can write it any more, so later duplicates are
+// merged into it directly. A stable frame is let go once the table
+// holds its only ref.
+//
+// The scanner only ever changes the page table of the process it
+// interrupted, which is safe without TLB shootdowns: its own TLB is
+// reloaded, and no other CPU can be running that process.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+pte_t* walkpgdirImport(pde_t *pgdir, const void *va, int alloc);
+
+struct ksmPage {
+  char *frame;  // kernel address of the frame, 0 if the slot is free
+  uint hash;    // hash of its contents when last scanned
+  int stable;   // merged into: the table holds a ref, nobody writes it
+};
+
+struct {
+  struct spinlock lock;
+  struct ksmPage page[NKSM];
+  int rate;     // pages scanned per tick, 0 when off
+  int next;     // unstable slot to reuse next
+} ksm;
+
+void
+ksminit(void)
+{
+  initlock(&ksm.lock, "ksm");
+}
+
+static uint
+pageHash(char *v)
+{
+  uint *w = (uint*)v;
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < PGSIZE/sizeof(uint); i++)
+    h = (h ^ w[i]) * 16777619;
+  return h;
+}
+
+// Slot holding frame v, or 0.
+static struct ksmPage*
+ksmFind(char *v)
+{
+  struct ksmPage *k;
+
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++)
+    if(k->frame == v)
+      return k;
+  return 0;
+}
+
+// A slot for a new unstable entry: a free one, else the next
+// unstable one round robin. Returns 0 if all slots are stable.
+static struct ksmPage*
+ksmSlot(void)
+{
+  struct ksmPage *k;
+  int i;
+
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++)
+    if(k->frame == 0)
+      return k;
+  for(i = 0; i < NKSM; i++){
+    k = &ksm.page[ksm.next];
+    ksm.next = (ksm.next + 1) % NKSM;
+    if(!k->stable)
+      return k;
+  }
+  return 0;
+}
+
+// Let go of stable frames that nobody maps any more.
+// Caller holds ksm.lock.
+static void
+ksmReap(void)
+{
+  struct ksmPage *k;
+
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    if(k->stable && getPageRefs(k->frame) == 1){
+      kfree(k->frame);
+      k->frame = 0;
+      k->stable = 0;
+    }
+  }
+}
+
+// Look at the page of p at va, merging it if it is a duplicate.
+// Caller holds ksm.lock.
+static void
+ksmPage(struct proc *p, uint va)
+{
+  struct ksmPage *k, *same, *mine;
+  pte_t *pte;
+  char *v;
+  uint h;
+
+  //page tables shared with a fork relative are left to unsharePgtab,
+  //large pages are not split for this
+  if(!(p->pgdir[PDX(va)] & PTE_P) || (p->pgdir[PDX(va)] & (PTE_COW | PTE_PS)))
+    return;
+  pte = walkpgdirImport(p->pgdir, (char*)va, 0);
+  if(pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_U) || (*pte & PTE_SHARED))
+    return;
+  v = P2V(PTE_ADDR(*pte));
+  //only frames this mapping has to itself: the zero page, the page
+  //cache and COW pages are shared already
+  if(getPageRefs(v) != 1 || getPageMapcount(v) != 1)
+    return;
+
+  h = pageHash(v);
+  mine = ksmFind(v);
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    if(k->stable && k->hash == h && memcmp(k->frame, v, PGSIZE) == 0){
+      //a duplicate of a merged frame: map that one instead
+      refIncrease(k->frame);
+      *pte = V2P(k->frame) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+      rmapRemove(v, p->pgdir, va);
+      rmapAdd(k->frame, p->pgdir, va);
+      lcr3(V2P(p->pgdir));
+      kfree(v);
+      if(mine)
+        mine->frame = 0;
+      return;
+    }
+  }
+  if(mine == 0){
+    if((mine = ksmSlot()) != 0){
+      mine->frame = v;
+      mine->hash = h;
+    }
+    return;
+  }
+  if(mine->hash != h){
+    //still being written, not worth merging yet
+    mine->hash = h;
+    return;
+  }
+  same = 0;
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    if(k != mine && !k->stable && k->frame && k->hash == h &&
+       memcmp(k->frame, v, PGSIZE) == 0){
+      same = k;
+      break;
+    }
+  }
+  if(same == 0)
+    return;
+  //make this frame the one the other copy gets merged into when
+  //its own process is scanned next
+  refIncrease(v);
+  *pte = (*pte & ~PTE_W) | PTE_COW;
+  lcr3(V2P(p->pgdir));
+  mine->stable = 1;
+  same->frame = 0;
+}
+
+// Called on a clock tick that interrupted the current process in
+// user space: scan its next ksm.rate pages below p->sz.
+void
+ksmScan(void)
+{
+  struct proc *p = myproc();
+  int i;
+
+  if(ksm.rate == 0 || p == 0 || p->sz == 0)
+    return;
+  acquire(&ksm.lock);
+  ksmReap();
+  for(i = 0; i < ksm.rate; i++){
+    if(p->ksmNext >= p->sz)
+      p->ksmNext = 0;
+    ksmPage(p, p->ksmNext);
+    p->ksmNext += PGSIZE;
+  }
+  release(&ksm.lock);
+}
+
+// Set the number of pages scanned per tick, 0 to stop merging,
+// unless rate is negative. Returns the number of pages merging
+// saves right now: the mappings of each merged frame but one.
+int
+ksmControl(int rate)
+{
+  struct ksmPage *k;
+  int saved;
+
+  acquire(&ksm.lock);
+  if(rate >= 0)
+    ksm.rate = rate;
+  ksmReap();
+  saved = 0;
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++)
+    if(k->stable && getPageMapcount(k->frame) > 1)
+      saved += getPageMapcount(k->frame) - 1;
+  release(&ksm.lock);
+  return saved;
+}
@@ -18,7 +18,16 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction is committed.
+//
+// Commits are grouped: end_op() does not commit, the logflush
+// kernel thread does, once no FS system calls are active and
+// either the transaction has been open for LOGFLUSHTICKS or
+// someone needs it on disk: a begin_op() short of log space, or
+// log_force(), which waits until the transaction it finds has
+// committed. Transactions are numbered, so log_force() only waits
+// for the one holding its caller's updates. Until then a crash
+// loses the transaction as a whole, never part of it.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,6 +37,22 @@
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// Mostly only metadata goes through the log. File data is written
+// with log_write_data(), which keeps the block pinned in the cache
+// like log_write() but has commit() write it straight to its home
+// location before the log, so it is on disk before any metadata
+// pointing to it commits, and is written once instead of twice.
+// Overwrites of existing data are not atomic, as with any ordered
+// journal. A block logged as metadata in the same transaction stays
+// in the log, so its logged copy is never older than its data.
+//
+// Ordering alone is not enough for a block freed and allocated
+// again in the same transaction: its old owner is still on disk
+// until the free commits, and writing the new contents home first
+// would hand them to the old owner after a crash, say as block
+// numbers of an indirect block. bfree() records such blocks with
+// log_free(), and log_write_data() logs them instead.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,13 +67,28 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int force;       // commit as soon as outstanding is 0.
+  uint seq;        // number of the open transaction.
+  uint committed;  // number of the last committed transaction.
+  uint opened;     // ticks when the open transaction logged its first block.
   int dev;
   struct logheader lh;
+  int ndata;       // ordered data blocks of the open transaction
+  int data[LOGSIZE];
+  uchar freed[(FSSIZE+7)/8]; // blocks freed by the open transaction
 };
+
+// blocks the open transaction will write
+#define PENDING (log.lh.n + log.ndata)
+
+// most blocks written by one disk command, half the buffers the
+// cache always has, so a commit cannot run out of them
+#define LOGBATCH (NBUF/2)
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logflusher(void);
 
 void
 initlog(int dev)
@@ -62,25 +102,54 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  log.seq = 1;
   recover_from_log();
+  kthread("logflush", logflusher);
 }
 
-// Copy committed blocks from log to their home location
+// Write the n blocks in blocks[] from the cache to their home
+// locations, sorted, with one disk command per run of up to LOGBATCH
+// adjacent blocks. If fromlog is set, blocks[i] is first copied
+// from log slot i.
 static void
-install_trans(void)
+write_home(int *blocks, int n, int fromlog)
 {
-  int tail;
+  struct buf *run[LOGBATCH];
+  int idx[LOGSIZE];
+  int i, j, k, t;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  // insertion sort of the slots by home block number
+  for (i = 0; i < n; i++) {
+    t = i;
+    for (j = i; j > 0 && blocks[idx[j-1]] > blocks[t]; j--)
+      idx[j] = idx[j-1];
+    idx[j] = t;
+  }
+
+  for (i = 0; i < n; i += k) {
+    for (k = 0; i+k < n && k < LOGBATCH; k++) {
+      if (k > 0 && blocks[idx[i+k]] != blocks[idx[i+k-1]] + 1)
+        break;
+      run[k] = bread(log.dev, blocks[idx[i+k]]);
+      if (fromlog) {
+        struct buf *lbuf = bread(log.dev, log.start+idx[i+k]+1); // read log block
+        memmove(run[k]->data, lbuf->data, BSIZE);  // copy block to dst
+        brelse(lbuf);
+      }
+    }
+    bwritev(run, k);
+    for (j = 0; j < k; j++)
+      brelse(run[j]);
   }
 }
 
+// Copy committed blocks from log to their home location
+static void
+install_trans(void)
+{
+  write_home(log.lh.block, log.lh.n, 1);
+}
+
 // Read the log header from disk into the in-memory log header
 static void
 read_head(void)
@@ -129,8 +198,10 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(PENDING + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      log.force = 1;
+      wakeup(&log.lh);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -141,57 +212,134 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// wakes the flusher if this was the last outstanding operation
+// and the transaction should commit now.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  if(log.outstanding == 0 && PENDING > 0)
+    wakeup(&log.lh);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Wait until the updates of all finished FS system calls are
+// committed, for callers that need them on disk.
+void
+log_force(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  if(PENDING > 0 || log.committing){
+    // the open transaction, or the one being committed
+    seq = log.seq;
+    log.force = 1;
+    wakeup(&log.lh);
+    while(log.committed < seq)
+      sleep(&log, &log.lock);
   }
   release(&log.lock);
+}
+
+// Number of transactions committed since boot.
+int
+log_commits(void)
+{
+  int n;
+
+  acquire(&log.lock);
+  n = log.committed;
+  release(&log.lock);
+  return n;
+}
+
+// Copy modified blocks from cache to log, LOGBATCH log blocks,
+// which are adjacent on disk, per disk command.
+static void
+write_log(void)
+{
+  struct buf *to[LOGBATCH];
+  int tail, k;
+
+  for (tail = 0; tail < log.lh.n; tail += k) {
+    for (k = 0; k < LOGBATCH && tail+k < log.lh.n; k++) {
+      to[k] = bread(log.dev, log.start+tail+k+1); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+k]); // cache block
+      memmove(to[k]->data, from->data, BSIZE);
+      brelse(from);
+    }
+    bwritev(to, k);  // write the log
+    for (k = 0; k < LOGBATCH && tail+k < log.lh.n; k++)
+      brelse(to[k]);
+  }
+}
+
+// Is the open transaction to be committed now?
+// Caller holds log.lock.
+static int
+commitdue(void)
+{
+  if(PENDING == 0 || log.outstanding > 0)
+    return 0;
+  return log.force || PENDING + MAXOPBLOCKS > LOGSIZE ||
+         ticks - log.opened >= LOGFLUSHTICKS;
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
+// The logflush kernel thread: commits transactions when they are
+// due, see the top of this file.
+static void
+logflusher(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  for(;;){
+    if(!commitdue()){
+      if(PENDING > 0 && log.outstanding == 0){
+        // only waiting for time to pass
+        release(&log.lock);
+        acquire(&tickslock);
+        sleep(&ticks, &tickslock);
+        release(&tickslock);
+        acquire(&log.lock);
+      } else
+        sleep(&log.lh, &log.lock);
+      continue;
+    }
+    log.committing = 1;
+    seq = log.seq;
+    release(&log.lock);
     commit();
     acquire(&log.lock);
     log.committing = 0;
+    log.force = 0;
+    memset(log.freed, 0, sizeof(log.freed));
+    log.committed = seq;
+    log.seq++;
     wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write ordered data blocks from cache to their home locations.
 static void
-write_log(void)
+write_data(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
+  write_home(log.data, log.ndata, 0);
+  log.ndata = 0;
 }
 
 static void
 commit()
 {
+  write_data();      // File data first, before metadata that points to it
   if (log.lh.n > 0) {
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
@@ -215,20 +363,77 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (PENDING >= LOGSIZE || log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
+  for (i = 0; i < log.ndata; i++) {
+    if (log.data[i] == b->blockno) {    // metadata now, log it instead
+      log.data[i] = log.data[--log.ndata];
+      break;
+    }
+  }
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
   log.lh.block[i] = b->blockno;
+  if (PENDING == 0)
+    log.opened = ticks;
   if (i == log.lh.n)
     log.lh.n++;
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
 
+// Like log_write(), for a block of file data: commit() writes it
+// to its home location before the log instead of through it.
+void
+log_write_data(struct buf *b)
+{
+  int i;
+
+  if (PENDING >= LOGSIZE)
+    panic("too big a transaction");
+  if (log.outstanding < 1)
+    panic("log_write_data outside of trans");
+
+  acquire(&log.lock);
+  if (log.freed[b->blockno/8] & (1 << (b->blockno%8))) {
+    // freed earlier in this transaction: its old owner may still
+    // point at it on disk, so it cannot be written home yet
+    release(&log.lock);
+    log_write(b);
+    return;
+  }
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno)   // already logged
+      break;
+  }
+  if (i == log.lh.n) {
+    for (i = 0; i < log.ndata; i++) {
+      if (log.data[i] == b->blockno)     // absorption
+        break;
+    }
+    if (PENDING == 0)
+      log.opened = ticks;
+    if (i == log.ndata)
+      log.data[log.ndata++] = b->blockno;
+  }
+  b->flags |= B_DIRTY; // prevent eviction
+  release(&log.lock);
+}
+
+// Block blockno was freed in the open transaction; see the top of
+// this file.
+void
+log_free(uint blockno)
+{
+  if (blockno >= FSSIZE)
+    panic("log_free");
+  acquire(&log.lock);
+  log.freed[blockno/8] |= 1 << (blockno%8);
+  release(&log.lock);
+}
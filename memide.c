@@ -58,3 +58,22 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+// Read ahead: the memory disk is done at once.
+void
+ideread(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  iderw(b);
+  bdone(b);
+}
+
+// Several adjacent blocks: one after the other, they are all in memory.
+void
+iderwv(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(b[i]);
+}
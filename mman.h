@@ -0,0 +1,35 @@
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_ANONYMOUS 0x20
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_COLD       20
+
+// mincore(): the state of one page, from its PTE and the pager
+#define MINCORE_RESIDENT   0x01  // in RAM (PTE_P)
+#define MINCORE_SWAPPED    0x02  // in the swap file (PTE_PG)
+#define MINCORE_COW        0x04  // copy-on-write, shared with a relative
+#define MINCORE_REFERENCED 0x08  // accessed since the last age update (PTE_A)
+#define MINCORE_DIRTY      0x10  // written since it was read in (PTE_D)
+#define MINCORE_SHARED     0x20  // MAP_SHARED or shm, never swapped
+#define MINCORE_LOCKED     0x40  // mlock()ed
+#define MINCORE_ZERO       0x80  // untouched heap on the shared zero page
+#define MINCORE_LARGE      0x100 // part of a 4 MiB page
+
+// mempressure(): how close the kernel is to taking pages away
+#define PRESSURE_NONE     0
+#define PRESSURE_LOW      1  // free memory is getting low, or pages are being evicted
+#define PRESSURE_MEDIUM   2
+#define PRESSURE_CRITICAL 3  // idle processes are being swapped out
+
+struct pagestat {
+  uint flags;   // MINCORE_*
+  uint age;     // the policy's age counter, 0 if the pager does not track the page
+};
@@ -83,6 +83,8 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define LPGSIZE         (PGSIZE*NPTENTRIES)  // bytes mapped by a large page (PTE_PS)
+#define LPGORDER        10      // log2 of the pages in a large page
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -97,7 +99,12 @@ struct segdesc {
 #define PTE_PS          0x080   // Page Size
 #define PTE_PG          0x200   // Paged out to secondary storage
 #define PTE_A           0x020   // reference bit
+#define PTE_D           0x040   // Dirty
 #define PTE_COW         0x400   // reference bit
+#define PTE_SHARED      0x800   // Shared mapping, never made COW
+
+// Page fault error code bits
+#define FEC_WR          0x002   // Page fault caused by a write
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -1,9 +1,9 @@
 #define NPROC        64  // maximum number of processes
-#define KSTACKSIZE 4096  // size of per-process kernel stack
+#define KSTACKSIZE 8192  // size of per-process kernel stack
+#define KSTACKORDER   1  // kernel stack is 2^KSTACKORDER contiguous pages
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unreferenced inodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -11,4 +11,12 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define MAXORDER     10  // largest buddy block is 2^MAXORDER pages (4 MiB)
+#define NSHM         16  // maximum number of shared memory segments
+#define MLOCKPAGES    8  // pages a process may mlock(), below MAX_PSYC_PAGES
+#define NKSM         64  // pages the same-page merging scanner keeps track of
+#define PARKTICKS   500  // ticks a process waits idle before it may be parked
+#define PARKLOWMARK 2048 // free frames below which idle processes are parked
+#define MAXREADAHEAD 32  // most blocks readi reads ahead of a sequential reader
+#define LOGFLUSHTICKS 10 // ticks a transaction may stay open before it is committed
 
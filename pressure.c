@@ -0,0 +1,91 @@
+// Memory pressure levels for user space.
+//
+// Once per tick the level is worked out again from the number of
+// free frames and from how many pages the kernel has had to take
+// away from processes lately (evictions to swap, dropped file
+// pages, parked processes). mempressure(min) returns at once if the
+// level is at least min, and otherwise blocks until it gets there,
+// so a process can shrink its caches before its pages are evicted.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "mman.h"
+
+struct {
+  struct spinlock lock;
+  int level;        // PRESSURE_* as of the last tick
+  uint reclaimed;   // pages taken away since the last tick
+  uint recent;      // decaying average of pages taken per tick, times 16
+} pressure;
+
+void
+pressureinit(void)
+{
+  initlock(&pressure.lock, "pressure");
+}
+
+// Note that n pages were taken out of RAM to make room.
+void
+pressureReclaim(int n)
+{
+  acquire(&pressure.lock);
+  pressure.reclaimed += n;
+  release(&pressure.lock);
+}
+
+static int
+pressureLevel(void)
+{
+  int level;
+
+  level = PRESSURE_NONE;
+  if(freePgFrameCounter * 4 < totalPgFrameCounter || pressure.recent >= 8)
+    level = PRESSURE_LOW;
+  if(freePgFrameCounter * 8 < totalPgFrameCounter || pressure.recent >= 32)
+    level = PRESSURE_MEDIUM;
+  if(freePgFrameCounter * 16 < totalPgFrameCounter ||
+     freePgFrameCounter < PARKLOWMARK || pressure.recent >= 128)
+    level = PRESSURE_CRITICAL;
+  return level;
+}
+
+// Called by the timer interrupt on one CPU every tick.
+void
+pressureTick(void)
+{
+  int level;
+
+  acquire(&pressure.lock);
+  pressure.recent += pressure.reclaimed*2 - pressure.recent/8;
+  pressure.reclaimed = 0;
+  level = pressureLevel();
+  if(level != pressure.level){
+    pressure.level = level;
+    wakeup(&pressure);
+  }
+  release(&pressure.lock);
+}
+
+// Wait until the pressure level is at least min.
+// Returns the level, or -1 if the process was killed.
+int
+pressureWait(int min)
+{
+  int level;
+
+  acquire(&pressure.lock);
+  while(pressure.level < min){
+    if(myproc()->killed){
+      release(&pressure.lock);
+      return -1;
+    }
+    sleep(&pressure, &pressure.lock);
+  }
+  level = pressure.level;
+  release(&pressure.lock);
+  return level;
+}
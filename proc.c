@@ -71,10 +71,12 @@ myproc(void) {
 //PAGEBREAK: 32
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
-// state required to run in the kernel.
+// state required to run in the kernel. Kernel threads get pid 0,
+// so that user processes keep their pids and the paging code,
+// which leaves pids 1 and 2 alone, leaves them alone too.
 // Otherwise return 0.
 static struct proc*
-allocproc(void)
+allocproc(int kernel)
 {
   struct proc *p;
   char *sp;
@@ -90,12 +92,13 @@ allocproc(void)
 
 found:
   p->state = EMBRYO;
-  p->pid = nextpid++;
+  p->pid = kernel ? 0 : nextpid++;
+  p->kthread = kernel;
 
   release(&ptable.lock);
 
   // Allocate kernel stack.
-  if((p->kstack = kalloc()) == 0){
+  if((p->kstack = kallocOrder(KSTACKORDER)) == 0){
     p->state = UNUSED;
     return 0;
   }
@@ -126,9 +129,11 @@ found:
       p->allPages[i].next = 0;
       ////TASK 3////
       p->allPages[i].pageData.ageCounter = SELECTION == LAPA ? 0xFFFFFFFF : 0;
+      p->allPages[i].pageData.locked = 0;
+      p->allPages[i].pageData.parked = 0;
       //////////////
     }
-    memset(&p->freeOffsetInFile,0,17);
+    memset(&p->freeOffsetInFile,0,sizeof(p->freeOffsetInFile));
     p->swapFile = 0;
     p->physHead = 0;
     p->physCounter = 0;
@@ -137,6 +142,12 @@ found:
     p->pageFaults = 0;
     p->pageTotalNumberOfPagedOut = 0;
   }
+  p->lockedPages = 0;
+  p->ksmNext = 0;
+  p->collapseNext = 0;
+  p->idle = 0;
+  p->parking = 0;
+  p->parked = 0;
   //////////////////////////////////////
 
   return p;
@@ -150,7 +161,7 @@ userinit(void)
   struct proc *p;
   extern char _binary_initcode_start[], _binary_initcode_size[];
 
-  p = allocproc();
+  p = allocproc(0);
   
   initproc = p;
   if((p->pgdir = setupkvm()) == 0)
@@ -180,6 +191,35 @@ userinit(void)
   release(&ptable.lock);
 }
 
+// A kernel thread's first scheduling by scheduler() will swtch
+// here, and "return" into the thread's function.
+static void
+kthreadret(void)
+{
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+}
+
+// Start a kernel thread running fn, which must never return.
+// It runs on its own kernel stack with only the kernel mapped.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc(1)) == 0 || (p->pgdir = setupkvm()) == 0)
+    panic("kthread");
+  //kthreadret returns to fn instead of trapret
+  *(uint*)(p->context + 1) = (uint)fn;
+  p->context->eip = (uint)kthreadret;
+  p->parent = 0;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -190,8 +230,17 @@ growproc(int n)
 
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // only reserve the address space, pages are allocated on
+    // first touch by the page fault handler (see lazyAlloc)
+    if(sz + n >= KERNBASE || sz + n < sz ||
+       vmaOverlap(curproc, sz, PGROUNDUP(sz + n)))
       return -1;
+    //paged processes may not reserve more than MAX_TOTAL_PAGES
+    if(SELECTION != NONE && curproc->pid > 2 &&
+       (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE >
+       MAX_TOTAL_PAGES - curproc->physCounter - curproc->fileCounter)
+      return -1;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
@@ -212,7 +261,7 @@ fork(void)
   struct proc *curproc = myproc();
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
@@ -220,7 +269,7 @@ fork(void)
   // TASK 2: copyOnCow instead of copyuvm
   if((np->pgdir = copyOnCow(curproc->pgdir, curproc->sz)) == 0){
   // if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
+    kfreeOrder(np->kstack, KSTACKORDER);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
@@ -249,9 +298,11 @@ fork(void)
       np->allPages[i].next = 0;
       //TASK 3//
       np->allPages[i].pageData.ageCounter = SELECTION == LAPA ? 0xFFFFFFFF : 0;
+      np->allPages[i].pageData.locked = 0;
+      np->allPages[i].pageData.parked = 0;
       //////////
     }
-    memset(&np->freeOffsetInFile,0,17);
+    memset(&np->freeOffsetInFile,0,sizeof(np->freeOffsetInFile));
     np->swapFile = 0;
     np->physHead = 0;
     np->physCounter = 0;
@@ -266,6 +317,20 @@ fork(void)
     if(curproc->ofile[i])
       np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  if(curproc->execip)
+    np->execip = idup(curproc->execip);
+  memmove(np->execSegs, curproc->execSegs, sizeof(curproc->execSegs));
+  np->nexecSegs = curproc->nexecSegs;
+  np->madvice = curproc->madvice;
+  np->lockedPages = 0;
+  np->parked = 0;
+  for(i = 0; i < MAX_VMAS; i++){
+    np->vmas[i] = curproc->vmas[i];
+    if(np->vmas[i].f)
+      filedup(np->vmas[i].f);
+    if(np->vmas[i].shm)
+      shmDup(np->vmas[i].shm);
+  }
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -294,6 +359,9 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // Write back and drop memory mappings.
+  vmaExit();
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -304,8 +372,12 @@ exit(void)
 
   begin_op();
   iput(curproc->cwd);
+  if(curproc->execip)
+    iput(curproc->execip);
   end_op();
   curproc->cwd = 0;
+  curproc->execip = 0;
+  curproc->nexecSegs = 0;
 
   // clearing process swap -> TASK 1
   if((SELECTION != NONE) && curproc->swapFile != 0){
@@ -353,6 +425,7 @@ wait(void)
   int havekids, pid;
   struct proc *curproc = myproc();
   
+  curproc->idleSince = ticks;
   acquire(&ptable.lock);
   for(;;){
     // Scan through table looking for exited children.
@@ -364,7 +437,7 @@ wait(void)
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
+        kfreeOrder(p->kstack, KSTACKORDER);
         p->kstack = 0;
         freevm(p->pgdir);
         p->pid = 0;
@@ -384,7 +457,7 @@ wait(void)
     }
 
     // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-    sleep(curproc, &ptable.lock);  //DOC: wait-sleep
+    idleSleep(curproc, &ptable.lock, 0);  //DOC: wait-sleep
   }
 }
 
@@ -410,7 +483,7 @@ scheduler(void)
     // Loop over process table looking for process to run.
     acquire(&ptable.lock);
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
+      if(p->state != RUNNABLE || p->parking)
         continue;
 
       // Switch to chosen process.  It is the process's job
@@ -528,6 +601,61 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Like sleep, for waits that may go on for a long time: for a
+// child, a pipe or a timer. The caller sets p->idleSince when the
+// wait begins. While memory is tight, a process that has waited
+// PARKTICKS may get its resident set written out to its swap file
+// (see parkSleepers). It is read back in before idleSleep returns,
+// unless keepParked is set because the caller will only go back to
+// sleep; that caller calls unpark() itself when it is done waiting.
+void
+idleSleep(void *chan, struct spinlock *lk, int keepParked)
+{
+  struct proc *p = myproc();
+
+  p->idle = 1;
+  sleep(chan, lk);
+  p->idle = 0;
+  if(p->parked && !keepParked){
+    //reading the swap file sleeps, lk cannot be held
+    release(lk);
+    unpark();
+    acquire(lk);
+  }
+}
+
+// Medium-term scheduling: while free frames are below PARKLOWMARK,
+// shrink the buffer cache, then write out the resident sets of processes that have waited idle
+// for PARKTICKS, so that the processes that run get their frames.
+// A process being parked is kept from running until it is done.
+void
+parkSleepers(void)
+{
+  struct proc *p;
+
+  if(freePgFrameCounter >= PARKLOWMARK)
+    return;
+  //cached disk blocks and inodes go first
+  bshrink();
+  ishrink();
+  if(SELECTION == NONE || freePgFrameCounter >= PARKLOWMARK)
+    return;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state != SLEEPING || !p->idle || p->parking || p->parked ||
+       p->pid <= 2 || p == myproc() || ticks - p->idleSince < PARKTICKS)
+      continue;
+    p->parking = 1;
+    release(&ptable.lock);
+    parkProc(p);
+    acquire(&ptable.lock);
+    p->parking = 0;
+    if(freePgFrameCounter >= PARKLOWMARK)
+      break;
+  }
+  release(&ptable.lock);
+}
+
 //PAGEBREAK!
 // Wake up all processes sleeping on chan.
 // The ptable lock must be held.
@@ -558,9 +686,12 @@ kill(int pid)
 {
   struct proc *p;
 
+  //pid 0 is kernel threads and free slots, neither can be killed
+  if(pid <= 0)
+    return -1;
   acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->pid == pid){
+    if(p->pid == pid && !p->kthread && p->state != UNUSED){
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
@@ -640,7 +771,7 @@ void copyProcesses(struct proc* curproc, struct proc* np){
         offset+= PGSIZE;
         memset(buffer, 0, PGSIZE);
       }
-      memmove(&np->freeOffsetInFile, &curproc->freeOffsetInFile,17);
+      memmove(&np->freeOffsetInFile, &curproc->freeOffsetInFile,sizeof(np->freeOffsetInFile));
     }
     // updates counters
     np->fileCounter = curproc->fileCounter;
@@ -649,6 +780,8 @@ void copyProcesses(struct proc* curproc, struct proc* np){
     // update the physical mem list
     for(int i = 0; i < MAX_TOTAL_PAGES; i++){
       np->allPages[i].pageData = curproc->allPages[i].pageData;
+      np->allPages[i].pageData.locked = 0;  //locks are not inherited
+      np->allPages[i].pageData.parked = 0;
       if(curproc->allPages[i].next != 0){
         np->allPages[i].next = &(np->allPages[curproc->allPages[i].next->pageData.indexInAllPages]);
       }
@@ -62,6 +62,8 @@ struct page {
   uint offsetIndex;
   uint indexInAllPages; 
   uint ageCounter;   //TASK 3
+  int locked;        // mlock()ed: resident and never chosen for eviction
+  int parked;        // written out by parkProc, read back by unpark
 };
 
 //list of pages in the phys-mem
@@ -72,6 +74,32 @@ struct memPage{
 };
 ///////////////////
 
+//demand-paged exec: a loadable ELF segment, read in from the
+//executable page by page on first touch
+#define MAX_EXEC_SEGS 4
+
+struct execSeg {
+  uint va;        // page aligned start of the segment
+  uint off;       // file offset of va
+  uint filesz;    // bytes read from the file, the rest is zero
+  uint memsz;     // bytes mapped
+  int writable;   // ELF_PROG_FLAG_WRITE
+};
+
+//memory mapped with mmap(): a file or anonymous memory
+#define MAX_VMAS 8
+
+struct vma {
+  uint start;       // page aligned, 0 if the slot is free
+  uint len;         // page aligned
+  int prot;         // PROT_READ, PROT_WRITE
+  int flags;        // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+  int advice;       // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+  struct file *f;   // mapped file, 0 for anonymous memory
+  struct shmSeg *shm; // attached shared memory segment, or 0
+  uint off;         // file offset of start
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -91,13 +119,26 @@ struct proc {
   struct file *swapFile;      //page file
   // added in task 1
   struct memPage allPages[MAX_TOTAL_PAGES];
-  char freeOffsetInFile[17];  // which entery in file is free (by offset) - 17 enteries
+  char freeOffsetInFile[MAX_TOTAL_PAGES];  // which entery in file is free (by offset)
   int physCounter;   // counts pages in RAM
   int fileCounter;   // count pages in Disk
   struct memPage *physHead; //head of the pages in the physical memory
   //TASK 4
   int pageFaults; //umber of times the process had page faults 
   int pageTotalNumberOfPagedOut; //total number of times in which pages were paged out
+  struct inode *execip;        // executable the segments are paged in from
+  struct execSeg execSegs[MAX_EXEC_SEGS];
+  int nexecSegs;
+  struct vma vmas[MAX_VMAS];   // mmap() regions, between sz and KERNBASE
+  int madvice;                 // madvise() advice outside the regions
+  int lockedPages;             // pages of allPages that are mlock()ed
+  uint ksmNext;                // next va the same-page merging scanner looks at
+  uint collapseNext;           // last page table collapseScan looked at
+  int idle;                    // asleep in idleSleep, may be parked
+  uint idleSince;              // ticks when the idle wait began
+  int parking;                 // parkSleepers is writing it out, do not run
+  int parked;                  // some of its resident set was parked
+  int kthread;                 // kernel thread (pid 0), see kthread()
 };
 
 // Process memory is laid out contiguously, low addresses first:
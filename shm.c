@@ -0,0 +1,124 @@
+// Shared memory segments.
+//
+// A segment is a set of zeroed frames found by an integer key.
+// shmat(key, size) attaches the segment with that key to the
+// calling process, creating it on first use, and maps all of
+// it at once as a shared mapping (PTE_SHARED): fork() shares it
+// instead of making it copy-on-write, and the swap code leaves
+// it alone. The segment holds one ref on each frame and every
+// mapping another, so a frame lives as long as anyone maps it.
+// The segment itself goes away with its last attachment.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+struct shmSeg {
+  int key;
+  int nattach;    // mmap() regions referring to the segment, 0 if free
+  uint npages;
+  char **frames;  // one page holding npages frame addresses
+};
+
+struct {
+  struct spinlock lock;
+  struct shmSeg seg[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shmtable");
+}
+
+// Release the frames of s, whose last attachment is gone.
+static void
+shmfree(struct shmSeg *s)
+{
+  uint i;
+
+  for(i = 0; i < s->npages; i++)
+    kfree(s->frames[i]);
+  kfree((char*)s->frames);
+  s->frames = 0;
+  s->npages = 0;
+}
+
+// Attach to the segment with the given key, creating it with
+// npages zeroed pages if there is none. An existing segment must
+// have at least npages pages. Returns the segment with one more
+// attachment, or 0 on error.
+struct shmSeg*
+shmGet(int key, uint npages)
+{
+  struct shmSeg *s, *free;
+
+  if(npages == 0 || npages > PGSIZE / sizeof(char*))
+    return 0;
+  acquire(&shmtable.lock);
+  free = 0;
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++){
+    if(s->nattach > 0 && s->key == key){
+      if(npages > s->npages){
+        release(&shmtable.lock);
+        return 0;
+      }
+      s->nattach++;
+      release(&shmtable.lock);
+      return s;
+    }
+    if(s->nattach == 0 && free == 0)
+      free = s;
+  }
+  if((s = free) == 0 || (s->frames = (char**)kalloc()) == 0){
+    release(&shmtable.lock);
+    return 0;
+  }
+  for(s->npages = 0; s->npages < npages; s->npages++){
+    if((s->frames[s->npages] = kalloc()) == 0){
+      shmfree(s);
+      release(&shmtable.lock);
+      return 0;
+    }
+    memset(s->frames[s->npages], 0, PGSIZE);
+  }
+  s->key = key;
+  s->nattach = 1;
+  release(&shmtable.lock);
+  return s;
+}
+
+// One more region refers to s (fork, or munmap splitting a region).
+void
+shmDup(struct shmSeg *s)
+{
+  acquire(&shmtable.lock);
+  s->nattach++;
+  release(&shmtable.lock);
+}
+
+// Drop an attachment of s, freeing the segment with the last one.
+void
+shmPut(struct shmSeg *s)
+{
+  acquire(&shmtable.lock);
+  if(--s->nattach == 0)
+    shmfree(s);
+  release(&shmtable.lock);
+}
+
+uint
+shmPages(struct shmSeg *s)
+{
+  return s->npages;
+}
+
+// Frame i of s, with a ref for the caller's mapping.
+char*
+shmFrame(struct shmSeg *s, uint i)
+{
+  refIncrease(s->frames[i]);
+  return s->frames[i];
+}
@@ -0,0 +1,269 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of a single size. Objects are carved
+// out of slabs, each slab being one page from kalloc() with a
+// struct slab header at its start. Each object is preceded by a
+// word that links it into its slab's free list while it is free,
+// so the object itself is never touched. Every object in a new slab is
+// run through the cache's constructor once, and callers must
+// hand objects back to kmemCacheFree() in their constructed state,
+// so the constructor is not run again on reuse.
+//
+// Each CPU keeps a small stack of free objects per cache, so that
+// most allocations and frees touch neither the cache lock nor
+// another CPU's cache lines. When a stack fills up, its older half
+// goes back to the slabs. A slab whose objects are all back is
+// returned to kalloc(), so apart from the objects on the CPU stacks,
+// at most NCPUCACHE per CPU, freed memory does not stay in a cache.
+//
+// Interface:
+// * kmemCacheCreate(name, size, ctor) sets up a cache.
+// * kmemCacheAlloc(c) returns an object or 0 if out of memory.
+// * kmemCacheFree(c, obj) gives it back.
+// * kmemCacheDrain(c) empties the calling CPU's stack, to give as
+//   many pages back as possible after freeing many objects.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+#define NSLABCACHE 16  // maximum number of object caches
+#define NCPUCACHE   8  // free objects kept per CPU per cache
+
+struct slab {
+  struct slab *prev;
+  struct slab *next;
+  struct kmemCache *cache;
+  uint inuse;            // objects handed out (including per-CPU stacks)
+  void **freeobj;        // free slots in this slab, linked through their first word
+};
+
+struct cpuCache {
+  int n;
+  void *obj[NCPUCACHE];
+};
+
+struct kmemCache {
+  char *name;
+  uint size;             // object size, rounded up to a word
+  uint stride;           // object size plus its free-list link
+  uint perslab;          // objects per slab
+  void (*ctor)(void*);
+  struct spinlock lock;
+  struct slab *partial;  // slabs with at least one free object
+  struct slab *full;     // slabs with no free object
+  struct cpuCache cpu[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmemCache cache[NSLABCACHE];
+  int ncache;
+} slabtable;
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+void
+slabinit(void)
+{
+  initlock(&slabtable.lock, "slabtable");
+}
+
+// Create a cache of objects of the given size. ctor may be 0.
+struct kmemCache*
+kmemCacheCreate(char *name, uint size, void (*ctor)(void*))
+{
+  struct kmemCache *c;
+
+  size = (size + 3) & ~3;
+  if(size + sizeof(void*) > PGSIZE - SLABHDR)
+    panic("kmemCacheCreate: object too big");
+
+  acquire(&slabtable.lock);
+  if(slabtable.ncache == NSLABCACHE)
+    panic("kmemCacheCreate: no caches");
+  c = &slabtable.cache[slabtable.ncache++];
+  release(&slabtable.lock);
+
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  c->size = size;
+  c->stride = size + sizeof(void*);
+  c->perslab = (PGSIZE - SLABHDR) / c->stride;
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  return c;
+}
+
+static void
+slabunlink(struct slab **head, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    *head = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->prev = s->next = 0;
+}
+
+static void
+slabpush(struct slab **head, struct slab *s)
+{
+  s->prev = 0;
+  s->next = *head;
+  if(*head)
+    (*head)->prev = s;
+  *head = s;
+}
+
+// Allocate and construct a new slab for c.
+// Called without c->lock held, since constructors may take locks.
+static struct slab*
+slabgrow(struct kmemCache *c)
+{
+  struct slab *s;
+  void **slot;
+  uint i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->prev = s->next = 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->freeobj = 0;
+  // link back to front so objects are handed out in address order
+  for(i = c->perslab; i > 0; i--){
+    slot = (void**)((char*)s + SLABHDR + (i-1)*c->stride);
+    if(c->ctor)
+      c->ctor(slot + 1);
+    *slot = s->freeobj;
+    s->freeobj = slot;
+  }
+  return s;
+}
+
+// Take one object out of a partial slab. Caller holds c->lock.
+static void*
+slabtake(struct kmemCache *c)
+{
+  struct slab *s;
+  void **slot;
+
+  s = c->partial;
+  slot = s->freeobj;
+  s->freeobj = *slot;
+  s->inuse++;
+  if(s->freeobj == 0){
+    slabunlink(&c->partial, s);
+    slabpush(&c->full, s);
+  }
+  return slot + 1;
+}
+
+// Put obj back into its slab. Caller holds c->lock.
+// Returns the slab if it became empty and was unlinked, else 0.
+static struct slab*
+slabput(struct kmemCache *c, void *obj)
+{
+  struct slab *s;
+  void **slot;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->cache != c)
+    panic("kmemCacheFree: wrong cache");
+  if(s->freeobj == 0){
+    slabunlink(&c->full, s);
+    slabpush(&c->partial, s);
+  }
+  slot = (void**)obj - 1;
+  *slot = s->freeobj;
+  s->freeobj = slot;
+  if(--s->inuse == 0 && (c->partial != s || s->next != 0)){
+    // keep the last partial slab around, give the rest back
+    slabunlink(&c->partial, s);
+    return s;
+  }
+  return 0;
+}
+
+void*
+kmemCacheAlloc(struct kmemCache *c)
+{
+  struct cpuCache *cc;
+  struct slab *s;
+  void *obj;
+
+  pushcli();
+  cc = &c->cpu[cpuid()];
+  if(cc->n > 0){
+    obj = cc->obj[--cc->n];
+    popcli();
+    return obj;
+  }
+  popcli();
+
+  acquire(&c->lock);
+  if(c->partial == 0){
+    release(&c->lock);
+    if((s = slabgrow(c)) == 0)
+      return 0;
+    acquire(&c->lock);
+    slabpush(&c->partial, s);
+  }
+  obj = slabtake(c);
+  release(&c->lock);
+  return obj;
+}
+
+// Put the n oldest objects on stack cc back into their slabs.
+// Caller has interrupts off, so cc stays this CPU's.
+static void
+cpuflush(struct kmemCache *c, struct cpuCache *cc, int n)
+{
+  struct slab *s, *empty;
+  int i;
+
+  empty = 0;
+  acquire(&c->lock);
+  for(i = 0; i < n; i++){
+    if((s = slabput(c, cc->obj[i])) != 0){
+      s->next = empty;
+      empty = s;
+    }
+  }
+  cc->n -= n;
+  memmove(cc->obj, cc->obj + n, cc->n * sizeof(cc->obj[0]));
+  release(&c->lock);
+
+  while((s = empty) != 0){
+    empty = s->next;
+    kfree((char*)s);
+  }
+}
+
+void
+kmemCacheFree(struct kmemCache *c, void *obj)
+{
+  struct cpuCache *cc;
+
+  pushcli();
+  cc = &c->cpu[cpuid()];
+  if(cc->n == NCPUCACHE)
+    cpuflush(c, cc, NCPUCACHE/2);
+  cc->obj[cc->n++] = obj;
+  popcli();
+}
+
+void
+kmemCacheDrain(struct kmemCache *c)
+{
+  struct cpuCache *cc;
+
+  pushcli();
+  cc = &c->cpu[cpuid()];
+  cpuflush(c, cc, cc->n);
+  popcli();
+}
@@ -17,9 +17,11 @@
 int
 fetchint(uint addr, int *ip)
 {
-  struct proc *curproc = myproc();
+  uint lim = userLimit(addr, 0);
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(lim == 0 || addr+4 < addr || addr+4 > lim)
+    return -1;
+  if(makeResident(addr, 4, 0) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -32,13 +34,15 @@ int
 fetchstr(uint addr, char **pp)
 {
   char *s, *ep;
-  struct proc *curproc = myproc();
+  uint lim = userLimit(addr, 0);
 
-  if(addr >= curproc->sz)
+  if(lim == 0 || userShared(addr))
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
+  ep = (char*)lim;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && makeResident((uint)s, 1, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -53,26 +57,37 @@ argint(int n, int *ip)
 }
 
 // Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// to a block of memory of size bytes, which the kernel writes if
+// write is set.  Check that the block lies within the process
+// size or within one mmap() region, writable if need be.
 int
-argptr(int n, char **pp, int size)
+argbuf(int n, char **pp, int size, int write)
 {
   int i;
-  struct proc *curproc = myproc();
- 
+  uint lim;
+
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  lim = userLimit(i, write);
+  if(size < 0 || lim == 0 || (uint)i+size < (uint)i || (uint)i+size > lim)
+    return -1;
+  if(makeResident(i, size, write) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Like argbuf, for a block the kernel may write.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// (Strings in shared mappings are refused, so the string can't
+// change between this check and being used by the kernel.)
 int
 argstr(int n, char **pp)
 {
@@ -100,6 +115,20 @@ extern int sys_read(void);
 extern int sys_sbrk(void);
 extern int sys_sleep(void);
 extern int sys_getNumberOfFreePages(void);
+extern int sys_getNumberOfFreeBlocks(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_msync(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_madvise(void);
+extern int sys_mlock(void);
+extern int sys_munlock(void);
+extern int sys_mincore(void);
+extern int sys_ksm(void);
+extern int sys_mempressure(void);
+extern int sys_fsync(void);
+extern int sys_getNumberOfCommits(void);
 extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
@@ -121,6 +150,20 @@ static int (*syscalls[])(void) = {
 [SYS_sleep]   sys_sleep,
 [SYS_uptime]  sys_uptime,
 [SYS_getNumberOfFreePages]  sys_getNumberOfFreePages,
+[SYS_getNumberOfFreeBlocks] sys_getNumberOfFreeBlocks,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_msync]   sys_msync,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_madvise] sys_madvise,
+[SYS_mlock]   sys_mlock,
+[SYS_munlock] sys_munlock,
+[SYS_mincore] sys_mincore,
+[SYS_ksm]     sys_ksm,
+[SYS_mempressure] sys_mempressure,
+[SYS_fsync]   sys_fsync,
+[SYS_getNumberOfCommits] sys_getNumberOfCommits,
 [SYS_open]    sys_open,
 [SYS_write]   sys_write,
 [SYS_mknod]   sys_mknod,
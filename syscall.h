@@ -21,3 +21,17 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_getNumberOfFreePages 22
+#define SYS_getNumberOfFreeBlocks 23
+#define SYS_mmap   24
+#define SYS_munmap 25
+#define SYS_msync  26
+#define SYS_shmat  27
+#define SYS_shmdt  28
+#define SYS_madvise 29
+#define SYS_mlock  30
+#define SYS_munlock 31
+#define SYS_mincore 32
+#define SYS_ksm    33
+#define SYS_mempressure 34
+#define SYS_fsync  35
+#define SYS_getNumberOfCommits 36
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -85,7 +86,7 @@ sys_write(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argbuf(1, &p, n, 0) < 0)
     return -1;
   return filewrite(f, p, n);
 }
@@ -103,6 +104,27 @@ sys_close(void)
   return 0;
 }
 
+// Return once what has been written to the file is on disk.
+// Commits are grouped, so this waits for the log to commit.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_INODE)
+    log_force();
+  return 0;
+}
+
+// number of log transactions committed since boot
+int
+sys_getNumberOfCommits(void)
+{
+  return log_commits();
+}
+
 int
 sys_fstat(void)
 {
@@ -442,3 +464,38 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+int
+sys_mmap(void)
+{
+  int addr, len, prot, flags, off;
+  struct file *f;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  f = 0;
+  if(!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+    return -1;
+  return vmaMap((uint)addr, len, prot, flags, f, 0, (uint)off);
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return vmaUnmap((uint)addr, len);
+}
+
+int
+sys_msync(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return vmaSync((uint)addr, len);
+}
@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "mman.h"
 
 int
 sys_fork(void)
@@ -56,6 +57,113 @@ sys_sbrk(void)
   return addr;
 }
 
+// Attach the shared memory segment with the given key, creating
+// it with size bytes if it does not exist. Returns its address.
+int
+sys_shmat(void)
+{
+  int key, size, addr;
+  struct shmSeg *s;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0 || size <= 0)
+    return -1;
+  if((s = shmGet(key, PGROUNDUP(size) / PGSIZE)) == 0)
+    return -1;
+  addr = vmaMap(0, shmPages(s) * PGSIZE, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS, 0, s, 0);
+  shmPut(s);
+  return addr;
+}
+
+int
+sys_madvise(void)
+{
+  int addr, len, advice;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0)
+    return -1;
+  return memAdvise((uint)addr, len, advice);
+}
+
+int
+sys_mlock(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return memLock((uint)addr, len, 1);
+}
+
+int
+sys_munlock(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return memLock((uint)addr, len, 0);
+}
+
+// Fill vec with the state of each page of [addr, addr+len).
+int
+sys_mincore(void)
+{
+  int addr, len, n;
+  struct pagestat *vec;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || len < 0 || (uint)addr + len < (uint)addr ||
+     (uint)addr + len > KERNBASE)
+    return -1;
+  n = PGROUNDUP(len) / PGSIZE;
+  //fetching vec pages it in first, so the scan sees the state after that
+  if(argptr(2, (void*)&vec, n*sizeof(*vec)) < 0)
+    return -1;
+  memStat(addr, n, vec);
+  return 0;
+}
+
+// Set the same-page merging scan rate, unless it is negative.
+// Returns the number of pages merging saves.
+int
+sys_ksm(void)
+{
+  int rate;
+
+  if(argint(0, &rate) < 0)
+    return -1;
+  return ksmControl(rate);
+}
+
+// Wait until the memory pressure level is at least min,
+// and return it.
+int
+sys_mempressure(void)
+{
+  int min;
+
+  if(argint(0, &min) < 0 || min < PRESSURE_NONE || min > PRESSURE_CRITICAL)
+    return -1;
+  return pressureWait(min);
+}
+
+// Detach the shared memory segment attached at addr.
+int
+sys_shmdt(void)
+{
+  int addr;
+  struct vma *v;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  for(v = myproc()->vmas; v < &myproc()->vmas[MAX_VMAS]; v++)
+    if(v->len > 0 && v->shm && v->start == (uint)addr)
+      return vmaUnmap(v->start, v->len);
+  return -1;
+}
+
 int
 sys_sleep(void)
 {
@@ -66,14 +174,17 @@ sys_sleep(void)
     return -1;
   acquire(&tickslock);
   ticks0 = ticks;
+  myproc()->idleSince = ticks0;
   while(ticks - ticks0 < n){
     if(myproc()->killed){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    //woken every tick, stay parked until the time is up
+    idleSleep(&ticks, &tickslock, 1);
   }
   release(&tickslock);
+  unpark();
   return 0;
 }
 
@@ -96,4 +207,15 @@ int
 sys_getNumberOfFreePages(void)
 {
   return freePgFrameCounter;
-}
\ No newline at end of file
+}
+
+// number of free buddy blocks of 2^order pages
+int
+sys_getNumberOfFreeBlocks(void)
+{
+  int order;
+
+  if(argint(0, &order) < 0)
+    return -1;
+  return kfreeBlocks(order);
+}
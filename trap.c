@@ -16,11 +16,12 @@ uint ticks;
 int pageSwap(uint va);
 pte_t* walkpgdirImport(pde_t *pgdir, const void *va, int alloc);
 int mappagesImport(pde_t *pgdir, void *va, uint size, uint pa, int perm);
+int isDemandZero(pte_t *pte, int write);
 
 void cowPgFault(uint va, pte_t* pte){
   uint pa = PTE_ADDR(*pte);
   uint flags = PTE_FLAGS(*pte) | PTE_W;
-  int refCount = getPageRefs((char*)va);
+  int refCount = getPageRefs((char*)P2V(pa));
   if(refCount == 1){
     *pte = *pte | PTE_W;
     lcr3(V2P(myproc()->pgdir));
@@ -34,7 +35,9 @@ void cowPgFault(uint va, pte_t* pte){
       memmove(newVAddr,(char*)P2V(pa),PGSIZE);  //copy page contents
       *pte = V2P(newVAddr) | flags;
       lcr3(V2P(myproc()->pgdir));
-      refDecrease((char*)va);
+      rmapRemove((char*)P2V(pa), myproc()->pgdir, va);
+      rmapAdd(newVAddr, myproc()->pgdir, va);
+      kfree((char*)P2V(pa));  //drop our ref to the shared frame
     }
   }
   else{
@@ -158,6 +161,7 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      pressureTick();
     }
     lapiceoi();
     break;
@@ -183,11 +187,33 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
   case T_PGFLT:
+    if(myproc() == 0){
+      goto defaultLabel;
+    }
     //increment number of page faults
     myproc()->pageFaults++;
     // use CR2 register to determine the faulting address and identify the page.
     uint va = PGROUNDDOWN(rcr2()); 
+    if(va >= KERNBASE){
+      goto defaultLabel;
+    }
+    // page table still shared with a fork relative -> get our own copy first
+    if(unsharePgtab(myproc()->pgdir, va) < 0){
+      cprintf("out of memory for page table\n");
+      goto defaultLabel;
+    }
     pte_t* pte = walkpgdirImport(myproc()->pgdir, (char*)va, 0);
+    // first touch of memory reserved by exec, sbrk or mmap -> page
+    // of the file, zero page or zeroed frame
+    if(isDemandZero(pte, tf->err & FEC_WR)){
+      if(lazyAlloc(va, tf->err & FEC_WR) < 0){
+        goto defaultLabel;
+      }
+      break;
+    }
+    if(pte == 0){
+      goto defaultLabel;
+    }
     //p is init or shell or SELECTION is NONE -> not swapping
     if(!(*pte & PTE_P) && (myproc()->pid <= 2 || SELECTION == NONE)) { 
       goto defaultLabel;
@@ -197,10 +223,17 @@ trap(struct trapframe *tf)
       pageAlgoAux(pte);
     }
     if(*pte & PTE_P){   // if PTE_P is set, then the page fault is a write page fault -> COW case handler
-      if(*pte & PTE_COW){ //for readonly original pages
-        *pte = *pte | PTE_W;
-        *pte = *pte & ~PTE_COW;
+      if(!(*pte & PTE_U)){ // guard page
+        goto defaultLabel;
       }
+      if(*pte & PTE_W){ // fault came from the shared page table, already fixed
+        break;
+      }
+      if(!(*pte & PTE_COW)){ // really read-only page
+        goto defaultLabel;
+      }
+      *pte = *pte | PTE_W;
+      *pte = *pte & ~PTE_COW;
       cowPgFault(va, pte);
     }
     else if(SELECTION != NONE){      //pgfault not related to cow
@@ -225,7 +258,8 @@ trap(struct trapframe *tf)
   //PAGEBREAK: 13
   default:
     defaultLabel: // page fault - page not exist
-    cprintf("process %d is inside default case\n", myproc()->pid);
+    if(myproc() != 0)
+      cprintf("process %d is inside default case\n", myproc()->pid);
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -246,6 +280,14 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
+  // Look for duplicate pages, and for pages that can be a large
+  // page again, of a process that is using the CPU.
+  if(myproc() && myproc()->state == RUNNING &&
+     tf->trapno == T_IRQ0+IRQ_TIMER && (tf->cs&3) == DPL_USER){
+    ksmScan();
+    collapseScan();
+  }
+
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct pagestat;
 
 // system calls
 int fork(void);
@@ -24,6 +25,20 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int getNumberOfFreePages(void);
+int getNumberOfFreeBlocks(int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int msync(void*, int);
+void* shmat(int, int);
+int shmdt(void*);
+int madvise(void*, int, int);
+int mlock(void*, int);
+int munlock(void*, int);
+int mincore(void*, int, struct pagestat*);
+int ksm(int);
+int mempressure(int);
+int fsync(int);
+int getNumberOfCommits(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
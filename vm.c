@@ -6,6 +6,12 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "stat.h"
+#include "file.h"
+#include "mman.h"
 
 void deleteFromRamAndbringFromSwap(struct memPage *pg);
 int fileToPhys(struct memPage* pg);
@@ -16,10 +22,39 @@ void removePgFromPhysList(struct memPage* pg);
 void addPgToPhysList(struct memPage *pg);
 void addPgToMemFromVa(char* addr);
 void freeFilePg(struct proc* p, struct memPage* pg);
+int pageSwap(uint va);
+static void freeUserRange(pde_t *pgdir, uint start, uint end, int refill);
+static void freePhysPg(struct proc* p, struct memPage* pg);
+static int adviceAt(struct proc *p, uint va);
+static void sequentialFault(struct proc *p, uint va);
+static int pageSwapOne(uint va);
+static int isLargePage(pde_t *pgdir, uint va);
+static int splitLargePage(pde_t *pgdir, uint va);
+static struct vma* findVma(struct proc *p, uint va);
+static void physListRemove(struct proc *p, struct memPage *pg);
+static void physListAdd(struct proc *p, struct memPage *pg);
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
+// Single read-only page of zeros, mapped PTE_COW at every untouched
+// heap page that is read before it is written.
+static char *zeropage;
+
+// A page of a file, cached on its inode so that every process
+// running the binary or mapping the file uses the same frame.
+// It holds the PGSIZE bytes of the file at off, zeros past the end
+// of the file; writei() and itrunc() keep it up to date.
+struct cachePage {
+  uint off;
+  char *mem;
+  struct cachePage *next;
+};
+
+static struct kmemCache *pagecache;
+
+#define READAHEAD 4  // pages brought in after a MADV_SEQUENTIAL fault
+
 //for when process is in freevm 
 int isGlobalPgdir = 0;
 pde_t* globalPgdir;
@@ -45,7 +80,11 @@ seginit(void)
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
+// create any required page table pages, and give pgdir its
+// own copy of the page table if it is shared with another
+// process (the caller is about to change the PTE).
+// A large page covering va is split into a page table first,
+// whatever alloc says: callers look at and change single pages.
 static pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
@@ -53,6 +92,10 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(alloc && unsharePgtab(pgdir, (uint)va) < 0)
+    return 0;
+  if(isLargePage(pgdir, (uint)va) && splitLargePage(pgdir, (uint)va) < 0)
+    return 0;
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
@@ -93,6 +136,154 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
   return 0;
 }
 
+// Large pages. A 4 MiB piece of anonymous memory that is aligned
+// and lies inside one region is mapped by a single page directory
+// entry with PTE_PS when a free 4 MiB block is at hand, saving the
+// page table and most of the TLB misses. Each of its frames has a
+// ref of its own, as if it were mapped page by page. Only processes
+// the pager does not track get them, since the swap code counts and
+// moves single pages. Anything that needs to see single pages (fork,
+// unmapping part of it, a fault on it) finds them through walkpgdir,
+// which splits the large page into a page table on the way; see
+// collapseScan for putting it back together.
+
+static int
+isLargePage(pde_t *pgdir, uint va)
+{
+  return (pgdir[PDX(va)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS);
+}
+
+// Map a zeroed large page at va, which is LPGSIZE aligned and
+// has no page table yet. Returns 0 on success, -1 on error.
+static int
+mapLargePage(pde_t *pgdir, uint va, int perm)
+{
+  char *mem;
+
+  if(pgdir[PDX(va)] & PTE_P)
+    return -1;
+  if((mem = kallocPages(LPGORDER)) == 0)
+    return -1;
+  memset(mem, 0, LPGSIZE);
+  pgdir[PDX(va)] = V2P(mem) | perm | PTE_P | PTE_PS;
+  return 0;
+}
+
+// Replace the large page covering va by a page table mapping the
+// same frames. Returns 0 on success, -1 if out of memory.
+static int
+splitLargePage(pde_t *pgdir, uint va)
+{
+  pde_t *pde = &pgdir[PDX(va)];
+  pte_t *pgtab;
+  uint i, base, pa;
+
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  base = PGADDR(PDX(va), 0, 0);
+  pa = PTE_ADDR(*pde);
+  for(i = 0; i < NPTENTRIES; i++){
+    pgtab[i] = (pa + i*PGSIZE) | (PTE_FLAGS(*pde) & ~PTE_PS);
+    rmapAdd(P2V(pa + i*PGSIZE), pgdir, base + i*PGSIZE);
+  }
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  if(myproc() != 0 && myproc()->pgdir == pgdir)
+    lcr3(V2P(pgdir));
+  return 0;
+}
+
+// Free the frames of the large page covering va.
+static void
+freeLargePage(pde_t *pgdir, uint va)
+{
+  pde_t *pde = &pgdir[PDX(va)];
+  uint i, pa;
+
+  pa = PTE_ADDR(*pde);
+  *pde = 0;
+  for(i = 0; i < NPTENTRIES; i++)
+    kfree(P2V(pa + i*PGSIZE));
+}
+
+// Can the aligned LPGSIZE piece of p at base be a large page of
+// demand-zero memory: anonymous, private, all in one region, and
+// not tracked by the pager?
+static int
+largePageFits(struct proc *p, uint base)
+{
+  struct execSeg *s;
+  struct vma *v;
+
+  if(p->pid > 2 && SELECTION != NONE)
+    return 0;
+  if((v = findVma(p, base)) != 0)
+    return v->f == 0 && !(v->flags & MAP_SHARED) && (v->prot & PROT_WRITE) &&
+           base + LPGSIZE <= v->start + v->len;
+  if(base + LPGSIZE > p->sz)
+    return 0;
+  for(s = p->execSegs; s < &p->execSegs[p->nexecSegs]; s++)
+    if(s->va < base + LPGSIZE && base < s->va + s->memsz)
+      return 0;
+  return 1;
+}
+
+// Called on a clock tick that interrupted the current process in
+// user space: look at its next page table, and if all of it maps
+// private pages of one region of anonymous memory, make it a large
+// page again. Frames that are already contiguous, as after a split,
+// are kept; otherwise the pages are copied into a new 4 MiB block.
+void
+collapseScan(void)
+{
+  struct proc *p = myproc();
+  pte_t *pgtab;
+  char *mem, *v;
+  uint i, j, base, pa;
+  int same;
+
+  if(p == 0 || (p->pid > 2 && SELECTION != NONE))
+    return;
+  //one page table per tick at most
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if(++p->collapseNext >= PDX(KERNBASE))
+      p->collapseNext = 0;
+    if((p->pgdir[p->collapseNext] & PTE_P) && !(p->pgdir[p->collapseNext] & PTE_PS))
+      break;
+  }
+  if(i == PDX(KERNBASE) || (p->pgdir[p->collapseNext] & PTE_COW))
+    return;
+  base = PGADDR(p->collapseNext, 0, 0);
+  if(!largePageFits(p, base))
+    return;
+  pgtab = (pte_t*)P2V(PTE_ADDR(p->pgdir[p->collapseNext]));
+  pa = PTE_ADDR(pgtab[0]);
+  same = pa % LPGSIZE == 0;
+  for(j = 0; j < NPTENTRIES; j++){
+    if((pgtab[j] & (PTE_P | PTE_U | PTE_W | PTE_COW | PTE_SHARED)) != (PTE_P | PTE_U | PTE_W))
+      return;
+    v = P2V(PTE_ADDR(pgtab[j]));
+    if(getPageRefs(v) != 1 || getPageMapcount(v) != 1)
+      return;
+    if(PTE_ADDR(pgtab[j]) != pa + j*PGSIZE)
+      same = 0;
+  }
+  if(same)
+    mem = P2V(pa);
+  else if((mem = kallocPages(LPGORDER)) == 0)
+    return;
+  for(j = 0; j < NPTENTRIES; j++){
+    v = P2V(PTE_ADDR(pgtab[j]));
+    rmapRemove(v, p->pgdir, base + j*PGSIZE);
+    if(!same){
+      memmove(mem + j*PGSIZE, v, PGSIZE);
+      kfree(v);
+    }
+  }
+  p->pgdir[p->collapseNext] = V2P(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+  lcr3(V2P(p->pgdir));
+  kfree((char*)pgtab);
+}
+
 // There is one page table per process, plus one that's used when
 // a CPU is not running any process (kpgdir). The kernel uses the
 // current process's page table during system calls and interrupts;
@@ -158,6 +349,22 @@ kvmalloc(void)
   switchkvm();
 }
 
+// Allocate the shared zero page. It keeps the ref from kalloc()
+// forever, so dropping its mappings never frees it.
+void
+zeroinit(void)
+{
+  if((zeropage = kalloc()) == 0)
+    panic("zeroinit");
+  memset(zeropage, 0, PGSIZE);
+}
+
+void
+pagecacheinit(void)
+{
+  pagecache = kmemCacheCreate("cachepage", sizeof(struct cachePage), 0);
+}
+
 // Switch h/w page table register to the kernel-only page table,
 // for when no process is running.
 void
@@ -203,29 +410,68 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   mem = kalloc();
   memset(mem, 0, PGSIZE);
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
+  rmapAdd(mem, pgdir, 0);
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+// Make room for one more resident page of the current process,
+// swapping a page out if it already has MAX_PSYC_PAGES in RAM.
+// Returns 0 on success, -1 if it reached MAX_TOTAL_PAGES.
+static int
+reserveUserPage(void)
 {
-  uint i, pa, n;
-  pte_t *pte;
+  struct proc* p = myproc();
 
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
+  parkSleepers();
+  if(SELECTION != NONE){
+    if(p->pid > 2){  //p isnt shell or init
+      // if reached MAX_TOTAL_PAGES -> fail
+      if(p->physCounter + p->fileCounter == MAX_TOTAL_PAGES)
+        return -1;
+      //if RAM is full, need to swap from file
+      if(p->physCounter == MAX_PSYC_PAGES){
+        if(p->swapFile == 0){
+          createSwapFile(p);
+        }
+        struct memPage* pg = getMemPage();  //get page from phys mem to swap
+
+        if(pg == 0 || physToFile(pg) != 0)
+          return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Back user address a in pgdir with a zeroed page, making room in
+// RAM first if the process already has MAX_PSYC_PAGES resident.
+// Returns 0 on success, -1 on error.
+static int
+allocUserPage(pde_t *pgdir, uint a)
+{
+  struct proc* p = myproc();
+  char *mem;
+
+  if(reserveUserPage() < 0)
+    return -1;
+  mem = kalloc();
+  if(mem == 0){
+    cprintf("allocuvm out of memory\n");
+    return -1;
+  }
+  memset(mem, 0, PGSIZE);
+  if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    cprintf("allocuvm out of memory (2)\n");
+    kfree(mem);
+    return -1;
+  }
+  rmapAdd(mem, pgdir, a);
+
+  //after clearing space for a new page in RAM -> adding the page
+  if(p->pid > 2){
+    if(SELECTION != NONE){
+      addPgToMemFromVa((char*)a);
+    }
   }
   return 0;
 }
@@ -235,8 +481,6 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 int
 allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
-  struct proc* p = myproc();
-  char *mem;
   uint a;
 
   if(newsz >= KERNBASE)
@@ -246,47 +490,1013 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    if(SELECTION != NONE){
-      if(p->pid > 2){  //p isnt shell or init
-        // if reached MAX_TOTAL_PAGES -> fail
-        if(p->physCounter + p->fileCounter == MAX_TOTAL_PAGES){
-          panic("reached max total pages - allocuvm\n");
-        }
-        //if RAM is full, need to swap from file
-        if(p->physCounter == MAX_PSYC_PAGES){
-          if(p->swapFile == 0){
-            createSwapFile(p);
-          }
-          struct memPage* pg = getMemPage();  //get page from phys mem to swap
-
-          if(physToFile(pg) != 0){
-            panic("allocuvm failed in physToFile\n");
-          }
-        }
-      }
-    }
-    mem = kalloc();
-    if(mem == 0){
-      cprintf("allocuvm out of memory\n");
+    if(allocUserPage(pgdir, a) < 0){
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
-      cprintf("allocuvm out of memory (2)\n");
-      deallocuvm(pgdir, newsz, oldsz);
+  }
+  return newsz;
+}
+
+// Does a fault on pte belong to demand-paged memory? True for a
+// page that was never touched (or was dropped, see physToFile),
+// and for a write to a page that so far was only read and maps
+// the shared zero page.
+int
+isDemandZero(pte_t *pte, int write)
+{
+  if(pte == 0 || !(*pte & (PTE_P | PTE_PG)))
+    return 1;
+  return write && (*pte & PTE_P) && PTE_ADDR(*pte) == V2P(zeropage);
+}
+
+// The segment of the running executable that covers va, or 0.
+static struct execSeg*
+findExecSeg(struct proc *p, uint va)
+{
+  struct execSeg *s;
+
+  if(p->execip == 0)
+    return 0;
+  for(s = p->execSegs; s < &p->execSegs[p->nexecSegs]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      return s;
+  return 0;
+}
+
+// The mmap() region of p that covers va, or 0.
+static struct vma*
+findVma(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[MAX_VMAS]; v++)
+    if(v->len > 0 && va >= v->start && va < v->start + v->len)
+      return v;
+  return 0;
+}
+
+// End of the memory of the current process that va lies in: the
+// process size, or the end of the mmap() region holding va. 0 if va
+// is in neither, or if write is set and the region is read-only.
+// System calls check user pointers against this.
+uint
+userLimit(uint va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(va < p->sz)
+    return p->sz;
+  if((v = findVma(p, va)) == 0 || (write && !(v->prot & PROT_WRITE)))
+    return 0;
+  return v->start + v->len;
+}
+
+// Can other processes write the memory of the current process at va?
+int
+userShared(uint va)
+{
+  struct vma *v;
+
+  return va >= myproc()->sz && (v = findVma(myproc(), va)) != 0 &&
+         (v->flags & MAP_SHARED);
+}
+
+// Does [start, end) overlap an mmap() region of p?
+int
+vmaOverlap(struct proc *p, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[MAX_VMAS]; v++)
+    if(v->len > 0 && start < v->start + v->len && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Is the page at va a private copy of a file page, which may be
+// dropped while clean and read in again later? True for pages of
+// the executable and of private file mappings.
+static int
+fileBacked(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  if(findExecSeg(p, va))
+    return 1;
+  v = findVma(p, va);
+  return v != 0 && v->f != 0 && (v->flags & MAP_PRIVATE);
+}
+
+// Return the frame holding the page of ip at off, reading it in
+// on the first request. The frame stays cached on ip, which holds
+// one ref on it, until ip's last ref goes away; the caller gets a
+// ref of its own. Caller holds ip's lock.
+static char*
+pageCacheGet(struct inode *ip, uint off)
+{
+  struct cachePage *c;
+  char *mem;
+  uint n;
+
+  for(c = ip->pages; c != 0; c = c->next){
+    if(c->off == off){
+      refIncrease(c->mem);
+      return c->mem;
+    }
+  }
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  n = 0;
+  if(off < ip->size){
+    n = ip->size - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+  }
+  if(n > 0 && readi(ip, mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+  //without a cache entry the page is simply private to the caller
+  if((c = kmemCacheAlloc(pagecache)) != 0){
+    c->off = off;
+    c->mem = mem;
+    c->next = ip->pages;
+    ip->pages = c;
+    refIncrease(mem);
+  }
+  return mem;
+}
+
+// writei() wrote the n bytes at src to ip at off: update the
+// cached pages, also where the write made the file longer, so
+// that mappings of the file see the new data.
+// Caller holds ip's lock.
+void
+pageCacheWrite(struct inode *ip, char *src, uint off, uint n)
+{
+  struct cachePage *c;
+  uint lo, hi;
+
+  for(c = ip->pages; c != 0; c = c->next){
+    lo = off > c->off ? off : c->off;
+    hi = off + n < c->off + PGSIZE ? off + n : c->off + PGSIZE;
+    if(lo < hi)
+      memmove(c->mem + (lo - c->off), src + (lo - off), hi - lo);
+  }
+}
+
+// itrunc() emptied ip: its cached pages are all past the end of
+// the file now. Caller holds ip's lock.
+void
+pageCacheTrunc(struct inode *ip)
+{
+  struct cachePage *c;
+
+  for(c = ip->pages; c != 0; c = c->next)
+    memset(c->mem, 0, PGSIZE);
+}
+
+// Drop the pages cached on ip when its last ref goes away.
+// Processes that still map them keep their frames.
+void
+pageCacheDrop(struct inode *ip)
+{
+  struct cachePage *c;
+
+  while((c = ip->pages) != 0){
+    ip->pages = c->next;
+    kfree(c->mem);
+    kmemCacheFree(pagecache, c);
+  }
+}
+
+// Map page va of the current process to the frame caching the
+// page of ip at off, of which it uses the first n bytes. The page
+// is private to the process: it is mapped read-only, and PTE_COW
+// if writable, so a write gives the process its own copy (see
+// cowPgFault). The PTE stays clean (PTE_D off) until then, which
+// is how physToFile knows it may drop the page instead of swapping
+// it. If n < PGSIZE (the end of an executable segment) the process
+// gets a copy with the rest zeroed straight away.
+static int
+filePageIn(struct proc *p, struct inode *ip, uint off, uint n, uint va, int writable)
+{
+  char *mem, *copy;
+
+  if(reserveUserPage() < 0)
+    return -1;
+  ilock(ip);
+  mem = pageCacheGet(ip, off);
+  iunlock(ip);
+  if(mem == 0)
+    return -1;
+  if(n < PGSIZE){
+    if((copy = kalloc()) == 0){
       kfree(mem);
-      return 0;
+      return -1;
+    }
+    memmove(copy, mem, n);
+    memset(copy + n, 0, PGSIZE - n);
+    kfree(mem);
+    mem = copy;
+  }
+  if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem),
+              PTE_U | (writable ? PTE_COW : 0)) < 0){
+    kfree(mem);
+    return -1;
+  }
+  rmapAdd(mem, p->pgdir, va);
+  if(p->pid > 2 && SELECTION != NONE)
+    addPgToMemFromVa((char*)va);
+  return 0;
+}
+
+// Map page va of segment s of the running executable. All
+// processes running the binary share the cached frames.
+static int
+execPageIn(struct proc *p, struct execSeg *s, uint va)
+{
+  uint off, n;
+
+  off = va - s->va;
+  n = 0;
+  if(off < s->filesz){
+    n = s->filesz - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+  }
+  return filePageIn(p, p->execip, s->off + off, n, va, s->writable);
+}
+
+// Map page va of file mapping v. A private mapping gets a copy
+// on write of the cached page. A shared mapping maps the cached
+// frame itself, as every other mapping of the page does, and is
+// not tracked as a resident page: swapping it out would leave
+// the process with a copy nobody else sees.
+static int
+vmaPageIn(struct proc *p, struct vma *v, uint va)
+{
+  struct inode *ip = v->f->ip;
+  uint off;
+  char *mem;
+
+  off = v->off + (va - v->start);
+  if(v->flags & MAP_PRIVATE)
+    return filePageIn(p, ip, off, PGSIZE, va, v->prot & PROT_WRITE);
+  ilock(ip);
+  mem = pageCacheGet(ip, off);
+  iunlock(ip);
+  if(mem == 0)
+    return -1;
+  if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem),
+              PTE_U | PTE_SHARED | ((v->prot & PROT_WRITE) ? PTE_W : 0)) < 0){
+    kfree(mem);
+    return -1;
+  }
+  rmapAdd(mem, p->pgdir, va);
+  return 0;
+}
+
+// Demand-paged memory: exec(), sbrk() and mmap() only reserve
+// address space, and the first touch of a page lands here from
+// the page fault handler. Pages of the executable's segments and
+// of file mappings are read in from the file. Elsewhere a read
+// maps the shared zero page read-only and a write (also to a
+// page mapping the zero page) gets a private zeroed frame. Only
+// private frames are tracked as resident pages, so the zero page
+// is never chosen for eviction or written to swap.
+// Returns 0 on success, -1 if va is not demand-paged memory.
+static int
+demandPage(struct proc *p, uint va, int write)
+{
+  struct execSeg *s;
+  struct vma *v;
+  pte_t *pte;
+
+  v = findVma(p, va);
+  if(v == 0 && va >= p->sz)
+    return -1;
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(!isDemandZero(pte, write))
+    return -1;
+  if(v != 0){
+    if(write && !(v->prot & PROT_WRITE))
+      return -1;
+    if(v->f != 0)
+      return vmaPageIn(p, v, va);
+    if(v->flags & MAP_SHARED)  //allocated by vmaMap, cannot be missing
+      return -1;
+    //private anonymous memory is demand-zero, like the heap
+  } else if((s = findExecSeg(p, va)) != 0)
+    return execPageIn(p, s, va);
+  if(!write){
+    if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(zeropage), PTE_U|PTE_COW) < 0)
+      return -1;
+    refIncrease(zeropage);
+    return 0;
+  }
+  if(largePageFits(p, va & ~(LPGSIZE-1)) &&
+     mapLargePage(p->pgdir, va & ~(LPGSIZE-1), PTE_W | PTE_U) == 0){
+    lcr3(V2P(p->pgdir));
+    return 0;
+  }
+  if(pte != 0 && (*pte & PTE_P)){
+    //drop the zero page mapping, the page is written for the first time
+    if(unsharePgtab(p->pgdir, va) < 0)
+      return -1;
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    *pte = 0;
+    lcr3(V2P(p->pgdir));
+    kfree(zeropage);
+  }
+  return allocUserPage(p->pgdir, va);
+}
+
+int
+lazyAlloc(uint va, int write)
+{
+  struct proc *p = myproc();
+
+  va = PGROUNDDOWN(va);
+  if(demandPage(p, va, write) < 0)
+    return -1;
+  if(adviceAt(p, va) == MADV_SEQUENTIAL)
+    sequentialFault(p, va);
+  return 0;
+}
+
+// Make sure the user range [va, va+len) of the current process is
+// resident, faulting in untouched and swapped-out pages, writable
+// ones if write is set. System calls use this before touching user
+// buffers while holding a spinlock, where a page fault must not
+// sleep on the swap file.
+int
+makeResident(uint va, uint len, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if(isLargePage(p->pgdir, a))
+      continue;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    //if the kernel writes the buffer, the zero page is not enough
+    if(isDemandZero(pte, write)){
+      if(lazyAlloc(a, write) < 0)
+        return -1;
+    } else if(*pte & PTE_PG){
+      if(pageSwap(a) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Write the page at mem back to ip at off, up to the end of the
+// file, in pieces small enough for one transaction each (see
+// filewrite). Returns 0 on success, -1 on error.
+static int
+writeBack(struct inode *ip, char *mem, uint off)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+  uint i, n, m;
+  int r = 0;
+
+  for(i = 0; r == 0; i += m){
+    begin_op();
+    ilock(ip);
+    n = 0;
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+    }
+    m = 0;
+    if(i < n){
+      m = n - i < max ? n - i : max;
+      if(writei(ip, mem + i, off + i, m) != m)
+        r = -1;
+    }
+    iunlock(ip);
+    end_op();
+    if(m == 0)
+      break;
+  }
+  return r;
+}
+
+// Map every page of shared anonymous mapping v up front, so that
+// fork relatives share it even where it was not touched yet. The
+// pages of a shared memory segment are the segment's frames.
+static int
+vmaPopulate(struct proc *p, struct vma *v)
+{
+  char *mem;
+  uint a;
+
+  for(a = v->start; a < v->start + v->len; a += PGSIZE){
+    if(!v->shm && a % LPGSIZE == 0 && a + LPGSIZE <= v->start + v->len &&
+       mapLargePage(p->pgdir, a, PTE_U | PTE_SHARED |
+                    ((v->prot & PROT_WRITE) ? PTE_W : 0)) == 0){
+      a += LPGSIZE - PGSIZE;
+      continue;
+    }
+    if(v->shm){
+      mem = shmFrame(v->shm, (a - v->start) / PGSIZE);
+    } else {
+      if((mem = kalloc()) == 0)
+        return -1;
+      memset(mem, 0, PGSIZE);
     }
+    if(mappages(p->pgdir, (char*)a, PGSIZE, V2P(mem),
+                PTE_U | PTE_SHARED | ((v->prot & PROT_WRITE) ? PTE_W : 0)) < 0){
+      kfree(mem);
+      return -1;
+    }
+    rmapAdd(mem, p->pgdir, a);
+  }
+  return 0;
+}
+
+// mmap(): map len bytes of f from off, or anonymous memory if f
+// is 0, at addr, or at the highest free range below KERNBASE if
+// addr is 0. Shared anonymous memory may be the shared memory
+// segment shm. Apart from shared anonymous memory nothing is
+// mapped yet, pages come in on first touch (see lazyAlloc).
+// Returns the address, or -1 on error.
+int
+vmaMap(uint addr, int len, int prot, int flags, struct file *f,
+       struct shmSeg *shm, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w;
+  uint sz = PGROUNDUP(p->sz);
+  int i;
 
-    //after clearing space for a new page in RAM -> adding the page
-    if(p->pid > 2){
-      if(SELECTION != NONE){
-        addPgToMemFromVa((char*)a);
+  if(len <= 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f != 0){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    //only regular files have pages: not devices, not directories
+    ilock(f->ip);
+    i = f->ip->type;
+    iunlock(f->ip);
+    if(i != T_FILE)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+  if(len > KERNBASE - sz)
+    return -1;
+  for(v = p->vmas; v < &p->vmas[MAX_VMAS] && v->len > 0; v++)
+    ;
+  if(v == &p->vmas[MAX_VMAS])
+    return -1;
+  if(addr != 0){
+    if(addr % PGSIZE != 0 || addr < sz || addr > KERNBASE - len ||
+       vmaOverlap(p, addr, addr + len))
+      return -1;
+  } else {
+    addr = KERNBASE - len;
+    for(i = 0; i < MAX_VMAS; i++){
+      w = &p->vmas[i];
+      if(w->len > 0 && addr < w->start + w->len && w->start < addr + len){
+        if(w->start < sz + len)
+          return -1;
+        addr = w->start - len;
+        i = -1;  //start over below w
       }
     }
   }
-  return newsz;
+
+  v->start = addr;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->advice = MADV_NORMAL;
+  v->f = f ? filedup(f) : 0;
+  v->shm = 0;
+  if(shm){
+    shmDup(shm);
+    v->shm = shm;
+  }
+  v->off = off;
+  if(f == 0 && (flags & MAP_SHARED) && vmaPopulate(p, v) < 0){
+    vmaUnmap(addr, len);
+    return -1;
+  }
+  return addr;
+}
+
+// msync(): write the dirty pages of shared file mappings in
+// [addr, addr+len) back to their files.
+// Returns 0 on success, -1 on error.
+int
+vmaSync(uint addr, int len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint a, end;
+  int r = 0;
+
+  end = addr + len;
+  if(addr % PGSIZE != 0 || len < 0 || end < addr || end > KERNBASE)
+    return -1;
+  for(a = addr; a < end; a += PGSIZE){
+    if((v = findVma(p, a)) == 0 || v->f == 0 || !(v->flags & MAP_SHARED))
+      continue;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_D))
+      continue;
+    if(writeBack(v->f->ip, P2V(PTE_ADDR(*pte)), v->off + (a - v->start)) < 0)
+      r = -1;
+    *pte &= ~PTE_D;
+  }
+  lcr3(V2P(p->pgdir));
+  return r;
+}
+
+// munmap(): unmap [addr, addr+len) of the mmap() regions, writing
+// dirty shared file pages back first.
+// Returns 0 on success, -1 on error.
+int
+vmaUnmap(uint addr, int len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w;
+  uint end, vend;
+
+  if(len <= 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  if(addr % PGSIZE != 0 || addr < p->sz || end < addr || end > KERNBASE)
+    return -1;
+  //punching a hole splits a region in two, that needs a free slot
+  for(v = p->vmas; v < &p->vmas[MAX_VMAS]; v++){
+    if(v->len > 0 && v->start < addr && v->start + v->len > end){
+      for(w = p->vmas; w < &p->vmas[MAX_VMAS] && w->len > 0; w++)
+        ;
+      if(w == &p->vmas[MAX_VMAS])
+        return -1;
+    }
+  }
+
+  vmaSync(addr, end - addr);
+  freeUserRange(p->pgdir, addr, end, 1);
+  lcr3(V2P(p->pgdir));
+
+  for(v = p->vmas; v < &p->vmas[MAX_VMAS]; v++){
+    if(v->len == 0 || end <= v->start || v->start + v->len <= addr)
+      continue;
+    vend = v->start + v->len;
+    if(addr <= v->start && end >= vend){
+      if(v->f)
+        fileclose(v->f);
+      if(v->shm)
+        shmPut(v->shm);
+      memset(v, 0, sizeof(*v));
+    } else if(addr <= v->start){
+      v->off += end - v->start;
+      v->start = end;
+      v->len = vend - end;
+    } else if(end >= vend){
+      v->len = addr - v->start;
+    } else {
+      for(w = p->vmas; w->len > 0; w++)
+        ;
+      *w = *v;
+      w->start = end;
+      w->off += end - v->start;
+      w->len = vend - end;
+      v->len = addr - v->start;
+      if(w->f)
+        filedup(w->f);
+      if(w->shm)
+        shmDup(w->shm);
+    }
+  }
+  return 0;
+}
+
+// Drop all mmap() regions of the current process, writing dirty
+// shared file pages back. Called by exit() and exec(); the pages
+// themselves go away with the page table.
+void
+vmaExit(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[MAX_VMAS]; v++){
+    if(v->len == 0)
+      continue;
+    if(v->f && (v->flags & MAP_SHARED))
+      vmaSync(v->start, v->len);
+    if(v->f)
+      fileclose(v->f);
+    if(v->shm)
+      shmPut(v->shm);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// The madvise() advice in force at va.
+static int
+adviceAt(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  if((v = findVma(p, va)) != 0)
+    return v->advice;
+  return p->madvice;
+}
+
+// MADV_COLD: make the resident page at va the next one to be
+// evicted, whatever the policy. It moves to the head of the
+// physHead list (SCFIFO, AQ), and loses its age (NFUA, LAPA) and
+// its PTE_A (no second chance).
+static void
+coldPage(struct proc *p, uint va)
+{
+  struct memPage *pg;
+  pte_t *pte;
+
+  if(p->pid <= 2 || SELECTION == NONE)
+    return;
+  for(pg = p->physHead; pg != 0; pg = pg->next)
+    if(pg->pageData.va == va)
+      break;
+  if(pg == 0)
+    return;
+  removePgFromPhysList(pg);
+  pg->next = p->physHead;
+  if(p->physHead != 0)
+    p->physHead->prev = pg;
+  p->physHead = pg;
+  pg->pageData.ageCounter = 0;
+  if((pte = walkpgdir(p->pgdir, (char*)va, 0)) != 0)
+    *pte &= ~PTE_A;
+}
+
+// MADV_SEQUENTIAL: after a fault at va, the page before it is
+// likely done with and goes first (drop-behind), and the next
+// READAHEAD pages are brought in from the swap file or from their
+// file now. Readahead only fills free resident slots: pushing
+// other pages out for it could evict the page just faulted in.
+static void
+sequentialFault(struct proc *p, uint va)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint a;
+
+  if(va >= PGSIZE)
+    coldPage(p, va - PGSIZE);
+  for(a = va + PGSIZE; a <= va + READAHEAD*PGSIZE && a < KERNBASE; a += PGSIZE){
+    if(adviceAt(p, a) != MADV_SEQUENTIAL)
+      break;
+    if(p->pid > 2 && SELECTION != NONE && p->physCounter >= MAX_PSYC_PAGES)
+      break;
+    if(isLargePage(p->pgdir, a))
+      break;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte != 0 && (*pte & PTE_PG)){
+      if(pageSwapOne(a) < 0)
+        break;
+    } else if(isDemandZero(pte, 0) &&
+              (findExecSeg(p, a) || ((v = findVma(p, a)) != 0 && v->f != 0))){
+      if(demandPage(p, a, 0) < 0)
+        break;
+    }
+  }
+}
+
+// madvise(): act on how the process will use [addr, addr+len).
+//   MADV_NORMAL, MADV_RANDOM: no readahead (the default).
+//   MADV_SEQUENTIAL: readahead and drop-behind on faults.
+//     These three are kept per mmap() region, and once for the
+//     rest of the address space, for the whole region touched.
+//   MADV_WILLNEED: bring the pages in now.
+//   MADV_DONTNEED: free the pages and their swap slots. The next
+//     touch reads them from their file again, or gives zeros.
+//   MADV_COLD: make the pages the first ones to be evicted.
+// Returns 0 on success, -1 on error.
+int
+memAdvise(uint addr, int len, int advice)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint a, end;
+
+  end = addr + len;
+  if(addr % PGSIZE != 0 || len < 0 || end < addr || end > KERNBASE)
+    return -1;
+  end = PGROUNDUP(end);
+  switch(advice){
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+  case MADV_SEQUENTIAL:
+    for(v = p->vmas; v < &p->vmas[MAX_VMAS]; v++)
+      if(v->len > 0 && addr < v->start + v->len && v->start < end)
+        v->advice = advice;
+    if(addr < p->sz)
+      p->madvice = advice;
+    return 0;
+  case MADV_WILLNEED:
+    for(a = addr; a < end; a += PGSIZE){
+      if(isLargePage(p->pgdir, a))
+        continue;
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(pte != 0 && (*pte & PTE_PG)){
+        if(pageSwapOne(a) < 0)
+          return -1;
+      } else if(isDemandZero(pte, 0)){
+        if(demandPage(p, a, 0) < 0)
+          return -1;
+      }
+    }
+    return 0;
+  case MADV_DONTNEED:
+    for(a = addr; a < end; a += PGSIZE){
+      v = findVma(p, a);
+      if(v == 0 && a >= p->sz)
+        continue;
+      //shared anonymous memory cannot be brought back
+      if(v != 0 && v->f == 0 && (v->flags & MAP_SHARED))
+        continue;
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(pte != 0 && (*pte & PTE_P) && !(*pte & PTE_U))
+        continue;  //guard page
+      if(v != 0 && v->f != 0 && (v->flags & MAP_SHARED))
+        vmaSync(a, PGSIZE);
+      freeUserRange(p->pgdir, a, a + PGSIZE, 0);
+    }
+    lcr3(V2P(p->pgdir));
+    return 0;
+  case MADV_COLD:
+    for(a = addr; a < end; a += PGSIZE)
+      coldPage(p, a);
+    return 0;
+  }
+  return -1;
+}
+
+// mlock() and munlock(): with lock set, make [addr, addr+len)
+// resident and keep every policy from choosing its pages for
+// eviction, otherwise let them be evicted again. A process may
+// hold at most MLOCKPAGES locked pages, so there is always room
+// left in RAM for the rest of it. Only pages the pager tracks
+// count: shared pages are never evicted anyway.
+// Returns 0 on success, -1 on error.
+int
+memLock(uint addr, int len, int lock)
+{
+  struct proc *p = myproc();
+  struct memPage *pg;
+  uint a, end;
+  int i, n;
+
+  end = addr + len;
+  if(addr % PGSIZE != 0 || len < 0 || end < addr || end > KERNBASE)
+    return -1;
+  end = PGROUNDUP(end);
+  if(lock){
+    //pages in the range that are not locked yet, at most
+    n = (end - addr) / PGSIZE;
+    for(i = 0; i < MAX_TOTAL_PAGES; i++){
+      pg = &p->allPages[i];
+      if(pg->pageData.locked && pg->pageData.va >= addr && pg->pageData.va < end)
+        n--;
+    }
+    if(p->lockedPages + n > MLOCKPAGES)
+      return -1;
+  }
+  for(a = addr; a < end; a += PGSIZE){
+    //lock each page as soon as it is in, before the next one can push it out
+    if(lock && makeResident(a, PGSIZE, 1) < 0)
+      return -1;
+    for(i = 0; i < MAX_TOTAL_PAGES; i++){
+      pg = &p->allPages[i];
+      if(pg->pageData.va != a || pg->pageData.state != PHYSICAL)
+        continue;
+      if(lock && !pg->pageData.locked)
+        p->lockedPages++;
+      else if(!lock && pg->pageData.locked)
+        p->lockedPages--;
+      pg->pageData.locked = lock;
+      break;
+    }
+  }
+  return 0;
+}
+
+// mincore(): describe each page of [addr, addr+npages*PGSIZE) in
+// st[]. A page with no bits set was never touched (or is not
+// mapped at all).
+void
+memStat(uint addr, int npages, struct pagestat *st)
+{
+  struct proc *p = myproc();
+  struct memPage *pg;
+  pte_t *pte;
+  uint a;
+  int i, j;
+
+  for(i = 0; i < npages; i++){
+    a = addr + i*PGSIZE;
+    st[i].flags = 0;
+    st[i].age = 0;
+    if(isLargePage(p->pgdir, a)){
+      //looking at the PTE would split it
+      st[i].flags = MINCORE_RESIDENT | MINCORE_LARGE;
+      pte = &p->pgdir[PDX(a)];
+      if(*pte & PTE_A)
+        st[i].flags |= MINCORE_REFERENCED;
+      if(*pte & PTE_D)
+        st[i].flags |= MINCORE_DIRTY;
+      if(*pte & PTE_SHARED)
+        st[i].flags |= MINCORE_SHARED;
+      continue;
+    }
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || !(*pte & (PTE_P | PTE_PG)))
+      continue;
+    if(*pte & PTE_P)
+      st[i].flags |= MINCORE_RESIDENT;
+    if(*pte & PTE_PG)
+      st[i].flags |= MINCORE_SWAPPED;
+    if(*pte & PTE_COW)
+      st[i].flags |= MINCORE_COW;
+    if(*pte & PTE_A)
+      st[i].flags |= MINCORE_REFERENCED;
+    if(*pte & PTE_D)
+      st[i].flags |= MINCORE_DIRTY;
+    if(*pte & PTE_SHARED)
+      st[i].flags |= MINCORE_SHARED;
+    if((*pte & PTE_P) && P2V(PTE_ADDR(*pte)) == zeropage)
+      st[i].flags |= MINCORE_ZERO;
+    for(j = 0; j < MAX_TOTAL_PAGES; j++){
+      pg = &p->allPages[j];
+      if(pg->pageData.state != FREE && pg->pageData.va == a){
+        st[i].age = pg->pageData.ageCounter;
+        if(pg->pageData.locked)
+          st[i].flags |= MINCORE_LOCKED;
+        break;
+      }
+    }
+  }
+}
+
+// Write the resident pages of q out to its swap file, for
+// parkSleepers. q is asleep and kept from running meanwhile, so
+// its page table and pager state can be changed from here; its
+// TLB entries went away when its CPU switched to another page
+// table. Clean file pages are dropped instead, and locked pages
+// and pages whose frame is mapped elsewhere too are left alone.
+// Returns the number of pages taken out of RAM.
+int
+parkProc(struct proc *q)
+{
+  struct memPage *pg, *next;
+  pte_t *pte;
+  char *v;
+  uint va;
+  int slot, n;
+
+  n = 0;
+  for(pg = q->physHead; pg != 0; pg = next){
+    next = pg->next;
+    va = pg->pageData.va;
+    if(pg->pageData.locked || unsharePgtab(q->pgdir, va) < 0)
+      continue;
+    pte = walkpgdir(q->pgdir, (char*)va, 0);
+    if(pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_U))
+      continue;
+    v = P2V(PTE_ADDR(*pte));
+    if(getPageMapcount(v) > 1)
+      continue;
+    slot = -1;
+    if(!(*pte & PTE_D) && fileBacked(q, va)){
+      *pte = 0;
+    } else {
+      for(slot = 0; slot < MAX_TOTAL_PAGES && q->freeOffsetInFile[slot]; slot++)
+        ;
+      if(slot == MAX_TOTAL_PAGES)
+        break;
+      if(q->swapFile == 0)
+        createSwapFile(q);
+      if(writeToSwapFile(q, v, slot*PGSIZE, PGSIZE) != PGSIZE)
+        break;
+      q->freeOffsetInFile[slot] = 1;
+      q->fileCounter++;
+      *pte = (*pte | PTE_PG) & ~PTE_P;
+    }
+    rmapRemove(v, q->pgdir, va);
+    kfree(v);
+    physListRemove(q, pg);
+    q->physCounter--;
+    q->pageTotalNumberOfPagedOut++;
+    if(slot >= 0){
+      pg->pageData.state = FILE;
+      pg->pageData.offsetIndex = slot*PGSIZE;
+      pg->pageData.parked = 1;
+      q->parked = 1;
+    } else {
+      pg->pageData.state = FREE;
+      pg->pageData.va = 0xFFFFFFFF;
+      pg->pageData.offsetIndex = -1;
+    }
+    n++;
+  }
+  if(n > 0)
+    pressureReclaim(n);
+  return n;
+}
+
+// Bring back the pages parkProc wrote out for the current process.
+// They were written into the lowest free slots, so they mostly lie
+// next to each other in the swap file: the slots from the first to
+// the last are read at once, straight into a block of contiguous
+// frames, and the frames of slots in between that hold other pages
+// are freed. If there is no such block or no room, the pages come
+// back one at a time.
+void
+unpark(void)
+{
+  struct proc *p = myproc();
+  struct memPage *pg;
+  char *mem, used[MAX_TOTAL_PAGES];
+  pte_t *pte;
+  int i, lo, hi, slot, order, count;
+
+  if(!p->parked)
+    return;
+  p->parked = 0;
+  lo = MAX_TOTAL_PAGES;
+  hi = -1;
+  count = 0;
+  for(pg = p->allPages; pg < &p->allPages[MAX_TOTAL_PAGES]; pg++){
+    if(pg->pageData.state != FILE || !pg->pageData.parked)
+      continue;
+    slot = pg->pageData.offsetIndex / PGSIZE;
+    if(slot < lo)
+      lo = slot;
+    if(slot > hi)
+      hi = slot;
+    count++;
+  }
+  if(count == 0)
+    return;
+  for(order = 0; (1 << order) < hi - lo + 1; order++)
+    ;
+  mem = 0;
+  if(p->physCounter + count <= MAX_PSYC_PAGES && (mem = kallocPages(order)) != 0 &&
+     readFromSwapFile(p, mem, lo*PGSIZE, (hi - lo + 1)*PGSIZE) != (hi - lo + 1)*PGSIZE){
+    for(i = 0; i < (1 << order); i++)
+      kfree(mem + i*PGSIZE);
+    mem = 0;
+  }
+  if(mem == 0){
+    for(pg = p->allPages; pg < &p->allPages[MAX_TOTAL_PAGES]; pg++)
+      if(pg->pageData.state == FILE && pg->pageData.parked)
+        pageSwapOne(pg->pageData.va);
+    return;
+  }
+
+  memset(used, 0, sizeof(used));
+  for(pg = p->allPages; pg < &p->allPages[MAX_TOTAL_PAGES]; pg++){
+    if(pg->pageData.state != FILE || !pg->pageData.parked)
+      continue;
+    slot = pg->pageData.offsetIndex / PGSIZE;
+    if((pte = walkpgdir(p->pgdir, (char*)pg->pageData.va, 1)) == 0)
+      panic("unpark");
+    //as in fileToPhys
+    *pte = V2P(mem + (slot - lo)*PGSIZE) | PTE_P | PTE_W | PTE_U | PTE_D;
+    rmapAdd(mem + (slot - lo)*PGSIZE, p->pgdir, pg->pageData.va);
+    used[slot - lo] = 1;
+    p->freeOffsetInFile[slot] = 0;
+    p->fileCounter--;
+    p->physCounter++;
+    pg->pageData.state = PHYSICAL;
+    pg->pageData.offsetIndex = -1;
+    pg->pageData.parked = 0;
+    pg->pageData.ageCounter = SELECTION == LAPA ? 0xFFFFFFFF : 0;
+    physListAdd(p, pg);
+  }
+  for(i = 0; i < (1 << order); i++)
+    if(i >= hi - lo + 1 || !used[i])
+      kfree(mem + i*PGSIZE);
+  lcr3(V2P(p->pgdir));
 }
 
 // Deallocate user pages to bring the process size from oldsz to
@@ -296,15 +1506,49 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
-  pte_t *pte;
-  uint a, pa;
   struct proc* p = myproc();
+  struct execSeg *s;
 
   if(newsz >= oldsz)
     return oldsz;
 
-  a = PGROUNDUP(newsz);
-  for(; a  < oldsz; a += PGSIZE){
+  //memory given back must not be read in from the executable
+  //again if the process grows back over it
+  if(p != 0 && p->pgdir == pgdir){
+    for(s = p->execSegs; s < &p->execSegs[p->nexecSegs]; s++){
+      if(s->va >= newsz)
+        s->memsz = s->filesz = 0;
+      else if(s->va + s->memsz > newsz){
+        s->memsz = newsz - s->va;
+        if(s->filesz > s->memsz)
+          s->filesz = s->memsz;
+      }
+    }
+  }
+
+  freeUserRange(pgdir, PGROUNDUP(newsz), oldsz, 1);
+  return newsz;
+}
+
+// Unmap and free the user pages in [start, end) of pgdir, and the
+// swap slots of those that are swapped out. With refill set, each
+// page freed from RAM lets a swapped-out page of the process back
+// in (see deleteFromRamAndbringFromSwap).
+static void
+freeUserRange(pde_t *pgdir, uint start, uint end, int refill)
+{
+  pte_t *pte;
+  uint a, pa;
+  struct proc* p = myproc();
+
+  for(a = start; a < end; a += PGSIZE){
+    if(isLargePage(pgdir, a) && a % LPGSIZE == 0 && a + LPGSIZE <= end){
+      freeLargePage(pgdir, a);
+      a += LPGSIZE - PGSIZE;
+      continue;
+    }
+    if(unsharePgtab(pgdir, a) < 0)
+      panic("deallocuvm: out of memory");
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
@@ -313,6 +1557,7 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       if(pa == 0)
         panic("deallocuvm 1\n");
       char *v = P2V(pa);
+      rmapRemove(v, pgdir, a);
       kfree(v);
       *pte = 0;
       if(p->pgdir == pgdir){
@@ -321,7 +1566,10 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
           for(int i=0; i<MAX_TOTAL_PAGES; i++){
             pg = &p->allPages[i];
             if(pg->pageData.va == a){
-              deleteFromRamAndbringFromSwap(pg);
+              if(refill)
+                deleteFromRamAndbringFromSwap(pg);
+              else
+                freePhysPg(p, pg);
               break;
             }
           }
@@ -342,26 +1590,36 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       }
     }
   }
-  return newsz;
 }
 
 void freeFilePg(struct proc* p, struct memPage* pg){
   p->freeOffsetInFile[pg->pageData.offsetIndex / PGSIZE] = 0;
+  pg->pageData.parked = 0;
   pg->pageData.state = FREE;
   pg->pageData.va = 0xFFFFFFFF;           
   pg->pageData.offsetIndex = -1;                
   p->fileCounter--;
 }
 
-void deleteFromRamAndbringFromSwap(struct memPage *pg){
-  struct proc* p = myproc();
-  //update page data
+//forget a resident page whose frame is gone
+static void freePhysPg(struct proc* p, struct memPage* pg){
+  removePgFromPhysList(pg);
   pg->pageData.va = 0xFFFFFFFF;
   pg->pageData.state = FREE;
   pg->pageData.offsetIndex = -1;
+  if(pg->pageData.locked){
+    pg->pageData.locked = 0;
+    p->lockedPages--;
+  }
   if (p->physCounter > 0){
     p->physCounter--;
   }
+}
+
+void deleteFromRamAndbringFromSwap(struct memPage *pg){
+  struct proc* p = myproc();
+  //update page data
+  freePhysPg(p, pg);
   //looking for page in file to swap
   if (p->fileCounter > 0){
     for (int i=0; i<MAX_TOTAL_PAGES; i++){
@@ -380,11 +1638,28 @@ void deleteFromRamAndbringFromSwap(struct memPage *pg){
 void
 freevm(pde_t *pgdir)
 {
-  uint i;
+  uint i, j;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
 
+  //page tables still shared with a fork relative: forget our
+  //rmap entries, drop our ref and leave the mappings to the other
+  //process; if we hold the last ref, the table is ours again and
+  //is freed below.
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if((pgdir[i] & PTE_P) && (pgdir[i] & PTE_COW)){
+      pte_t *pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[i]));
+      for(j = 0; j < NPTENTRIES; j++)
+        if(pgtab[j] & PTE_P)
+          rmapRemove(P2V(PTE_ADDR(pgtab[j])), pgdir, PGADDR(i, j, 0));
+      if(refDropShared((char*)pgtab))
+        pgdir[i] = 0;
+      else
+        pgdir[i] = (pgdir[i] | PTE_W) & ~PTE_COW;
+    }
+  }
+
   //other process deleting curproc va, so use his global pgdir
   globalPgdir = pgdir;
   isGlobalPgdir = 1;
@@ -441,6 +1716,7 @@ copyuvm(pde_t *pgdir, uint sz)
         kfree(mem);
         goto bad;
       }
+      rmapAdd(mem, d, i);
     }
     //page in file
     else{
@@ -510,20 +1786,21 @@ pte_t* walkpgdirImport(pde_t *pgdir, const void *va, int alloc){
 }
 
 //bring page from file to phys-mem (replace between them)
-int pageSwap(uint va){
+static int
+pageSwapOne(uint va){
   struct memPage* filePage;
 
   // find page in allPages array
   for(int i=0; i<MAX_TOTAL_PAGES; i++){
     filePage = &myproc()->allPages[i];
     if (filePage->pageData.va == va){
-      struct memPage* memPage = getMemPage();  //get page from phys mem to swap
-      if(!memPage){
-        //writing page from phys mem to file
-        if(physToFile(memPage) < 0){
+      //RAM is full -> make room by writing a page from phys mem to file
+      if(myproc()->physCounter >= MAX_PSYC_PAGES){
+        struct memPage* memPage = getMemPage();  //get page from phys mem to swap
+        if(memPage == 0 || physToFile(memPage) < 0){
           panic("failed in pageSwap - physToFile\n");
         }
-      } 
+      }
        //bringing page from file to phys-mem
       if(fileToPhys(filePage) < 0){
         panic("failed in pageSwap - fileToPhys\n");
@@ -534,18 +1811,43 @@ int pageSwap(uint va){
   return -1; // page not exist
 }
 
+int pageSwap(uint va){
+  if(pageSwapOne(va) < 0)
+    return -1;
+  if(adviceAt(myproc(), va) == MADV_SEQUENTIAL)
+    sequentialFault(myproc(), va);
+  return 0;
+}
+
 //writing page to file & clear ram from deleted page
 int  physToFile(struct memPage* pg) {
   pte_t *pte;
+  char *v;
   struct proc* p = myproc();
   //check if process is in freevm
   pde_t * pgdir = isGlobalPgdir ? globalPgdir : p->pgdir;
 
+  //the PTE is about to change, it must not be shared with a fork relative
+  if(unsharePgtab(pgdir, pg->pageData.va) < 0){
+    return -1;
+  }
   pte = walkpgdir(pgdir, (char*)pg->pageData.va, 0);
   //write page to swap file
   if((*pte & PTE_P) == 0){
     panic("SHOULD NOT HAPPEN\n");
   }
+  //clean page of the executable: no need to write it to swap,
+  //drop it and read it in from the file again on the next touch
+  if(pgdir == p->pgdir && !(*pte & PTE_D) && fileBacked(p, pg->pageData.va)){
+    v = P2V(PTE_ADDR(*pte));
+    *pte = 0;
+    rmapRemove(v, pgdir, pg->pageData.va);
+    kfree(v);
+    lcr3(V2P(pgdir));
+    freePhysPg(p, pg);
+    pressureReclaim(1);
+    return 0;
+  }
   if (pte == 0 || addPgToSwap(pg) == -1){
     return -1;
   }
@@ -561,8 +1863,10 @@ int  physToFile(struct memPage* pg) {
   //add page to pyhsical-mem lis
 
   //clear page from RAM
+  rmapRemove(P2V(PTE_ADDR(*pte)), pgdir, pg->pageData.va);
   kfree(P2V(PTE_ADDR(*pte)));
   lcr3(V2P(pgdir));
+  pressureReclaim(1);
   return 0;
 }
 
@@ -581,6 +1885,7 @@ int fileToPhys(struct memPage* pg){
 
   // create pte for pg
   mappages(pgdir, (char*)pg->pageData.va, PGSIZE, V2P(va), PTE_U |PTE_W);
+  rmapAdd(va, pgdir, pg->pageData.va);
   // read swap to RAM
   if (readFromSwapFile(myproc(), va, pg->pageData.offsetIndex, PGSIZE) == -1){
     return -1;
@@ -591,10 +1896,16 @@ int fileToPhys(struct memPage* pg){
   }
 
   
-  //set flags & states
-  *pte = (PTE_P | *pte) & (~PTE_PG);
+  //set flags & states. The page was written out once, so it is
+  //marked dirty: it must never be dropped as a clean file page
+  *pte = (PTE_P | PTE_D | *pte) & (~PTE_PG);
+  //the swap slot is free again
+  p->freeOffsetInFile[pg->pageData.offsetIndex / PGSIZE] = 0;
+  p->fileCounter--;
+  p->physCounter++;
   pg->pageData.state = PHYSICAL;
   pg->pageData.offsetIndex = -1;
+  pg->pageData.parked = 0;
   //TASK 3
   pg->pageData.ageCounter = SELECTION == LAPA ? 0xFFFFFFFF : 0;
   addPgToPhysList(pg);
@@ -615,20 +1926,42 @@ unsigned int countSetBits(uint n) {
 } 
 /////
 
-//return page to swap from phys mem -> by SELECTION page algorithm 
-struct memPage* getMemPage(){
+// A page can be evicted if it is a present user page that is not
+// mlock()ed. With
+// privateOnly set, pages whose frame is also mapped by another
+// address space are skipped too: swapping those out only drops
+// one mapping and frees no memory.
+static int
+evictable(pde_t *pgdir, struct memPage *pg, int privateOnly)
+{
+  pte_t *pte = walkpgdir(pgdir, (char*)pg->pageData.va, 0);
+
+  if(pte == 0 || !(*pte & PTE_U) || !(*pte & PTE_P))
+    return 0;
+  if(pg->pageData.locked)
+    return 0;
+  if(privateOnly && getPageMapcount(P2V(PTE_ADDR(*pte))) > 1)
+    return 0;
+  return 1;
+}
+
+//return page to swap from phys mem -> by SELECTION page algorithm,
+//or 0 if there is no page that may be evicted
+static struct memPage*
+selectMemPage(int privateOnly){
   struct proc* p = myproc();
   pde_t* pgdir = isGlobalPgdir ? globalPgdir : p->pgdir;
 
   //return the page to remove from mem & write to disk
-  struct memPage* pg = p->physHead;
+  struct memPage* pg = 0;
   struct memPage* tmpPg = p->physHead;
+  int rotations = 0;
   //choose paging algo
   switch(SELECTION){
     case(NFUA): //return page with the lowest ageCounter 
       while (tmpPg != 0){
-        pte_t *pte = walkpgdir(pgdir, (char*)tmpPg->pageData.va, 0);
-        if(pg->pageData.ageCounter > tmpPg->pageData.ageCounter && (*pte & PTE_U) && (*pte & PTE_P)){
+        if(evictable(pgdir, tmpPg, privateOnly) &&
+           (pg == 0 || pg->pageData.ageCounter > tmpPg->pageData.ageCounter)){
           pg = tmpPg;
         }
         tmpPg = tmpPg->next;
@@ -636,8 +1969,12 @@ struct memPage* getMemPage(){
       break;
     case(LAPA): //return page with the least ones at ageCounter
       while (tmpPg != 0){
-        pte_t *pte = walkpgdir(pgdir, (char*)tmpPg->pageData.va, 0);
-        if(!(*pte & PTE_U) || !(*pte & PTE_P)){
+        if(!evictable(pgdir, tmpPg, privateOnly)){
+          tmpPg = tmpPg->next;
+          continue;
+        }
+        if(pg == 0){
+          pg = tmpPg;
           tmpPg = tmpPg->next;
           continue;
         }
@@ -657,14 +1994,17 @@ struct memPage* getMemPage(){
     case(SCFIFO):
       while(tmpPg != 0){
         pte_t *pte = walkpgdir(pgdir, (char*)tmpPg->pageData.va, 0);
-        if(!(*pte & PTE_U) || (*pte & PTE_A) || !(*pte & PTE_P)){
-          //kernel or presented page
-            removePgFromPhysList(tmpPg);
-            addPgToPhysList(tmpPg);
-            if (*pte & PTE_A){
-              *pte &= (~PTE_A);
-            }
-            tmpPg = p->physHead;
+        if(pte == 0 || !evictable(pgdir, tmpPg, privateOnly) || (*pte & PTE_A)){
+          //kernel, shared or presented page -> second chance
+          //give up after going around the list twice
+          if(++rotations > 2 * p->physCounter)
+            break;
+          removePgFromPhysList(tmpPg);
+          addPgToPhysList(tmpPg);
+          if (pte != 0 && (*pte & PTE_A)){
+            *pte &= (~PTE_A);
+          }
+          tmpPg = p->physHead;
         }
         else{ //found page to swap
           pg = tmpPg;
@@ -672,8 +2012,13 @@ struct memPage* getMemPage(){
         }
       }
       break;
-    case(AQ): //just returns the head of the list, the updates happens in trap.c
-      pg = p->physHead; //oldest page
+    case(AQ): //the oldest page first, the queue updates happen in trap.c
+      for(tmpPg = p->physHead; tmpPg != 0; tmpPg = tmpPg->next){
+        if(evictable(pgdir, tmpPg, privateOnly)){
+          pg = tmpPg;
+          break;
+        }
+      }
       break;
     case(NONE):
       panic("case NONE.. not sappose to get here..\n");
@@ -685,6 +2030,17 @@ struct memPage* getMemPage(){
   return pg;
 }
 
+//return page to swap from phys mem -> by SELECTION page algorithm.
+//Pages no other process shares are preferred, since evicting
+//them actually frees a frame.
+struct memPage* getMemPage(){
+  struct memPage* pg;
+
+  if((pg = selectMemPage(1)) == 0)
+    pg = selectMemPage(0);
+  return pg;
+}
+
 //adding page to file
 int addPgToSwap(struct memPage* pg){
   pte_t *pte;
@@ -693,14 +2049,14 @@ int addPgToSwap(struct memPage* pg){
 
   // return free offset in file
   int offset;
-  for (offset= 0; offset < MAX_PSYC_PAGES+1; offset++){
+  for (offset= 0; offset < MAX_TOTAL_PAGES; offset++){
     if(myproc()->freeOffsetInFile[offset] == 0){
       break;
     }
   }
   pte = walkpgdir(pgdir, (char*)pg->pageData.va , 0);
 
-  if (!(*pte & PTE_P) || pte == 0 || offset == MAX_PSYC_PAGES+1){
+  if (!(*pte & PTE_P) || pte == 0 || offset == MAX_TOTAL_PAGES){
     if(!(*pte & PTE_P)){
       panic("failed in addPgToSwap1.1\n");
     }
@@ -709,7 +2065,7 @@ int addPgToSwap(struct memPage* pg){
       panic("failed in addPgToSwap1.2\n");
     }
 
-    if(offset == MAX_PSYC_PAGES+1){
+    if(offset == MAX_TOTAL_PAGES){
       panic("failed in addPgToSwap1.3\n");
     }
 
@@ -729,12 +2085,19 @@ int addPgToSwap(struct memPage* pg){
 }
 
 void removePgFromPhysList(struct memPage* pg){ 
-  struct proc* p = myproc();
+  physListRemove(myproc(), pg);
+}
+
+static void
+physListRemove(struct proc *p, struct memPage *pg)
+{
 
   // page to remove from physList is the head
   if(pg->prev == 0){
     p->physHead = pg->next;
-    p->physHead->prev = 0;
+    if(p->physHead != 0){
+      p->physHead->prev = 0;
+    }
   }
   // pg is not head of physList
   else{ 
@@ -751,7 +2114,12 @@ void removePgFromPhysList(struct memPage* pg){
 
 //add page from phys list
 void addPgToPhysList(struct memPage *pg){
-  struct proc* p = myproc();
+  physListAdd(myproc(), pg);
+}
+
+static void
+physListAdd(struct proc *p, struct memPage *pg)
+{
   struct memPage *tmp = p->physHead;
   if(p->physHead != 0){ //inserting page to the end of the physList
     while (tmp->next != 0){
@@ -817,50 +2185,93 @@ void addPgToMemFromVa(char* addr){
 
 
 // TASK 2: copyOnCow
+// Fork shares the parent's page tables with the child instead of
+// copying them: every user PDE is marked read-only and PTE_COW in
+// both page directories and the page table page gets one ref per
+// sharer. Nothing below the page directory is touched, so fork
+// costs O(number of page directory entries). The first fault in a
+// 4 MiB region gives the faulting process its own page table (see
+// unsharePgtab), and only then are the pages themselves made COW.
 pde_t* copyOnCow(pde_t *pgdir, uint sz){
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
+  uint i;
 
+  //large pages cannot be shared as page tables, or made COW in one
+  for(i = 0; i < PDX(KERNBASE); i++)
+    if(isLargePage(pgdir, PGADDR(i, 0, 0)) && splitLargePage(pgdir, PGADDR(i, 0, 0)) < 0)
+      return 0;
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyOnCow: pte should exist");
-    //page in RAM || file
-    if(!((*pte & PTE_P) || (*pte & PTE_PG))) 
-      panic("copyOnCow: page not present");
-    
-    //page in RAM
-    pa = PTE_ADDR(*pte);
-    if(PTE_P & *pte){
-      *pte &= ~PTE_W;
-      flags = PTE_FLAGS(*pte);
-      if(*pte & PTE_W){ //for readonly original pages
-        *pte = *pte & ~PTE_W;
-        *pte = *pte | PTE_COW;
-      }
-      if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0) {
-        goto bad;
-      }
-      refIncrease((char*)P2V(pa)); //increase page ref count
-    }
-    else{
-      //pte of the page in file
-      pte_t *swapPte = walkpgdir(d, (void*) i, 1); 
-      *swapPte = (*pte & 0xfff);
-    }
+  for(i = 0; i < PDX(KERNBASE); i++){  //mmap() regions lie above sz
+    if(!(pgdir[i] & PTE_P))
+      continue;
+    pgdir[i] = (pgdir[i] & ~PTE_W) | PTE_COW;
+    d[i] = pgdir[i];
+    refIncrease(P2V(PTE_ADDR(pgdir[i])));  //one more sharer of the page table
   }
   
   lcr3(V2P(pgdir)); 
   return d;
-
-bad:
-  freevm(d);
-  return 0;
 }
 
+// If the page table covering va is shared with a fork relative
+// (see copyOnCow), give pgdir its own copy. The copy and the
+// original then share the pages instead: each present page gets
+// a ref for the new table and writable pages become PTE_COW in
+// both. If the other sharers are gone the table is simply taken
+// back. Pages of shared mappings (PTE_SHARED) stay writable.
+// Returns 0 on success, -1 if out of memory.
+int
+unsharePgtab(pde_t *pgdir, uint va)
+{
+  pde_t *pde;
+  pte_t *old, *new;
+  uint i, base;
+  char *v;
+
+  pde = &pgdir[PDX(va)];
+  if(!(*pde & PTE_P) || !(*pde & PTE_COW))
+    return 0;
+  old = (pte_t*)P2V(PTE_ADDR(*pde));
+  base = PGADDR(PDX(va), 0, 0);
 
+  if(getPageRefs((char*)old) > 1){
+    if((new = (pte_t*)kalloc()) == 0)
+      return -1;
+    //copy while still holding our ref, so the table cannot be
+    //taken over and changed by the last other sharer meanwhile
+    for(i = 0; i < NPTENTRIES; i++){
+      if(old[i] & PTE_P){
+        if((old[i] & PTE_W) && !(old[i] & PTE_SHARED))
+          old[i] = (old[i] & ~PTE_W) | PTE_COW;
+        v = P2V(PTE_ADDR(old[i]));
+        refIncrease(v);
+        if(v != zeropage)
+          rmapAdd(v, pgdir, base + i*PGSIZE);
+      }
+      new[i] = old[i];
+    }
+    if(refDropShared((char*)old)){
+      *pde = V2P(new) | PTE_P | PTE_W | PTE_U;
+      goto done;
+    }
+    //the others let go while we were copying: undo the copy
+    for(i = 0; i < NPTENTRIES; i++)
+      if(new[i] & PTE_P)
+        kfree(P2V(PTE_ADDR(new[i])));
+    kfree((char*)new);
+  }
+  //we are the last sharer, the table is ours again
+  *pde = (*pde | PTE_W) & ~PTE_COW;
+  for(i = 0; i < NPTENTRIES; i++)
+    if((old[i] & PTE_P) && P2V(PTE_ADDR(old[i])) != zeropage)
+      rmapAdd(P2V(PTE_ADDR(old[i])), pgdir, base + i*PGSIZE);
+
+done:
+  if(myproc() != 0 && myproc()->pgdir == pgdir)
+    lcr3(V2P(pgdir));
+  return 0;
+}
 
 //PAGEBREAK!
 // Blank page.